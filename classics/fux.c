@@ -11,16 +11,45 @@
  *
  * make fux creates the C program
  * cc fux.c -c -O -DCM creates the module
+ * cc fux.c -O -DTHREADS -lpthread -o fux runs the batch modes on several threads
  *
  * See the "main" function for examples, or fux.lisp (which ties fux.c into CMN/CM).
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* with THREADS each thread has its own copy of the solver's state (the "Local" globals) */
+#ifdef THREADS
+#include <pthread.h>
+#define Local __thread
+#else
+#define Local
+#endif
 
 #ifndef inline
 #define inline
 #endif
 
+/* the rule checkers are expanded into each (species, voices) instantiation below */
+#ifdef __GNUC__
+#define Specialized static __inline__ __attribute__((always_inline))
+#else
+#define Specialized static
+#endif
+
 inline int ABS(int i) {if (i < 0) return(-i); else return(i);}
 inline int MIN(int a, int b) {if (a < b) return(a); else return(b);}
 inline int MAX(int a, int b) {if (a > b) return(a); else return(b);}
@@ -52,31 +81,24 @@ int Dissonance[13] =          {0,1,1,0,0,1,1,0,0,0,1,1,0};
 #define Ionian 6
 #define Locrian 7
 
-int _Ionian[12] =     {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 1};
-int _Dorian[12] =     {1, 0, 1, 1, 0, 1, 0, 1, 0, 1, 1, 0};
-int _Phrygian[12] =   {1, 1, 0, 1, 0, 1, 0, 1, 1, 0, 1, 0};
-int _Lydian[12] =     {1, 0, 1, 0, 1, 0, 1, 1, 0, 1, 0, 1};
-int _Mixolydian[12] = {1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 1, 0};
-int _Aeolian[12] =    {1, 0, 1, 1, 0, 1, 0, 1, 0, 0, 1, 0};
-int _Locrian[12] =    {1, 1, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0};
+/* each mode's pitch classes above the final, bit n set if n semitones up is in it */
+int ModeMask[8] = {
+  0,
+  0x4ad,	/* Aeolian:    0 2 3 5 7 10 */
+  0x6ad,	/* Dorian:     0 2 3 5 7 9 10 */
+  0x5ab,	/* Phrygian:   0 1 3 5 7 8 10 */
+  0xad5,	/* Lydian:     0 2 4 6 7 9 11 */
+  0x6b5,	/* Mixolydian: 0 2 4 5 7 9 10 */
+  0xab5,	/* Ionian:     0 2 4 5 7 9 11 */
+  0x56b};	/* Locrian:    0 1 3 5 6 8 10 */
 
 inline int InMode(int Pitch, int Mode)
 {
   int pit;
-  if (Pitch>11)
-    pit = Pitch % 12;
-  else pit=Pitch;
-  switch (Mode)
-    {
-    case Ionian:     return(_Ionian[pit]); break;
-    case Aeolian:    return(_Aeolian[pit]); break;
-    case Dorian:     return(_Dorian[pit]); break;
-    case Phrygian:   return(_Phrygian[pit]); break;
-    case Lydian:     return(_Lydian[pit]); break;
-    case Mixolydian: return(_Mixolydian[pit]); break;
-    case Locrian:    return(_Locrian[pit]); break;
-    }
-  return(0);
+  pit=(Pitch % 12);
+  if (pit < 0) pit += 12;
+  if (((unsigned)Mode) > Locrian) return(0);
+  return((ModeMask[Mode] >> pit) & 1);
 }
 
 int BadMelodyInterval[13] = {0,0,0,0,0,0,1,0,0,1,1,1,0};
@@ -131,24 +153,75 @@ inline int ExtremeRange(int Pitch) {return(Pitch>(HighestSemitone-3) || Pitch<(L
 #define MostNotes 128
 #define MostVoices 6
 
-int BasePitch,Mode,TotalTime;
+Local int BasePitch,Mode,TotalTime;
+
+Local int Ctrpt[MostNotes][MostVoices];
+Local int Onset[MostNotes][MostVoices];
+Local int Dur[MostNotes][MostVoices];
+Local int TotalNotes[MostVoices];
+
+/* Sounded[t][v] has bit n set when voice v sounds pitch class n at eighth t; SetUs keeps it
+ * up to date, anything that stores into Ctrpt directly calls SoundAll before searching.
+ */
+#define MostTimes (MostNotes*8)
+Local short Sounded[MostTimes][MostVoices];
 
-int Ctrpt[MostNotes][MostVoices];
-int Onset[MostNotes][MostVoices];
-int Dur[MostNotes][MostVoices];
-int TotalNotes[MostVoices];
+/* A streaming solve (StreamSpecies) sees only a window of the piece; these
+ * carry in what the rules need from the notes already committed and gone.
+ * Outside a stream they are empty and EndNotes is TotalNotes.
+ */
+Local int EndNotes[MostVoices];		/* the final's note number, past TotalNotes if the piece goes on */
+Local int NotesBefore[MostVoices];	/* notes of the piece before Ctrpt[1] */
+Local int CarriedLow[MostVoices],CarriedHigh[MostVoices];	/* their range (0 = none) */
+Local int CarriedPitches[MostVoices][MostNotes];	/* how often each (absolute) pitch came up */
+Local int CarriedIntervals[MostVoices][17];	/* melodic intervals, indexed like TooMuchOfInterval */
+Local int CarriedCross[MostVoices];	/* crossings of the cantus */
+Local int CarriedBelow[MostVoices];	/* whether the piece began below the cantus */
+Local int SettledNotes[MostVoices];	/* leading (pinned) notes already scored, which Look takes as is */
+
+void ClearCarried()
+{
+  int i,v;
+  for (v=0;v<MostVoices;v++)
+    {
+      EndNotes[v]=TotalNotes[v];
+      NotesBefore[v]=0; SettledNotes[v]=0; CarriedLow[v]=0; CarriedHigh[v]=0; CarriedCross[v]=0; CarriedBelow[v]=0;
+      for (i=0;i<MostNotes;i++) CarriedPitches[v][i]=0;
+      for (i=0;i<17;i++) CarriedIntervals[v][i]=0;
+    }
+}
 
 inline int Us(int n, int v) {return(Ctrpt[n][v]);}
-inline int LastNote(int n, int v) {return(n == TotalNotes[v]);}
+inline int LastNote(int n, int v) {return(n == EndNotes[v]);}
 inline int FirstNote(int n, int v) {return(n == 1);}
-inline int NextToLastNote(int n, int v) {return(n == (TotalNotes[v]-1));}
-inline void SetUs(int n, int p, int v) {Ctrpt[n][v]=p;}
+inline int NextToLastNote(int n, int v) {return(n == (EndNotes[v]-1));}
+inline int PitchBit(int p) {return(1 << (((p % 12) + 12) % 12));}	/* Ctrpt pitches go below BasePitch */
+
+inline void SetUs(int n, int p, int v)
+{
+  int t,Bit;
+  Ctrpt[n][v]=p;
+  Bit=PitchBit(p);
+  for (t=Onset[n][v];t<(Onset[n][v]+Dur[n][v]);t++) Sounded[t][v]=Bit;
+}
+
+void SoundAll(int NumParts)
+{
+  int i,v,t,Bit;
+  for (v=0;v<=NumParts;v++)
+    for (i=1;i<=TotalNotes[v];i++)
+      {
+	Bit=PitchBit(Ctrpt[i][v]);
+	for (t=Onset[i][v];(t<(Onset[i][v]+Dur[i][v])) && (t<MostTimes);t++) Sounded[t][v]=Bit;
+      }
+}
 
 inline int TotalRange(int Cn, int Cp, int v)
 {
   int Minp,Maxp,i,pit;
   Minp=Cp;
   Maxp=Cp;
+  if (CarriedLow[v]) {Minp=MIN(Minp,CarriedLow[v]-BasePitch); Maxp=MAX(Maxp,CarriedHigh[v]-BasePitch);}
   for (i=1;i<Cn;i++)
     {
       pit=Us(i,v);
@@ -192,7 +265,7 @@ inline int UpBeat(int n, int v) {return(!(DownBeat(n,v)));}
 inline int PitchRepeats(int Cn, int Cp, int v)
 {
   int i,k;
-  i=0;
+  i=(((Cp+BasePitch) >= 0) && ((Cp+BasePitch) < MostNotes)) ? CarriedPitches[v][Cp+BasePitch] : 0;
   for (k=1;k<Cn;k++) {if (Us(k,v) == Cp) i++;}
   return(i);
 }
@@ -227,7 +300,7 @@ int TooMuchOfInterval(int Cn, int Cp, int v)
 {
   int Ints[17];
   int i,k,MinL;
-  for (i=0;i<17;i++) Ints[i]=0;
+  for (i=0;i<17;i++) Ints[i]=CarriedIntervals[v][i];
   for (i=2;i<Cn;i++)
     {
       k=(Size(Ctrpt[i][v]-Ctrpt[i-1][v])+8);
@@ -239,7 +312,7 @@ int TooMuchOfInterval(int Cn, int Cp, int v)
   return(Ints[k]>(Ints[MinL]+6));
 }
 
-int ADissonance(int Interval, int Cn, int Cp, int v, int Species)
+Specialized int ADissonance(int Interval, int Cn, int Cp, int v, int Species)
 {
   int MelInt;
   if ((Species == 1) || (Dur[Cn][v] == WholeNote))
@@ -299,16 +372,19 @@ int ADissonance(int Interval, int Cn, int Cp, int v, int Species)
   return(0);
 }
 
-int Doubled(int Pitch, int Cn, int v)
+/* the pitch classes the voices below v sound at Cn's onset, bit n for pitch class n */
+inline int Sounding(int Cn, int v)
 {
-  int VNum;
-  for (VNum=0;VNum<v;VNum++)
-    {
-      if ((Other(Cn,v,VNum) % 12) == Pitch) return(1);
-    }
-  return(0);
+  int VNum,Mask;
+  short *Now;
+  Now=Sounded[Onset[Cn][v]];
+  Mask=0;
+  for (VNum=0;VNum<v;VNum++) Mask |= Now[VNum];
+  return(Mask);
 }
 
+inline int Doubled(int Pitch, int Cn, int v) {return((Sounding(Cn,v) >> Pitch) & 1);}
+
 #define infinity 1000000
 #define Bad 100
 #define RealBad 200
@@ -396,8 +472,58 @@ int Doubled(int Pitch, int Cn, int v)
 #define CrossAboveCantusPenalty		infinity
 #define NoMotionAgainstOctavePenalty    34
 
-int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other2, int NumParts,
-			int Species, int MelInt, int Interval, int ActInt, int LastIntClass, int Pitch, int LastMelInt, int CurLim)
+/* and these for generating cantus firmi */
+#define CantusOverOctavePenalty		3
+#define TooManySkipsPenalty		infinity
+#define RepeatedClimaxPenalty		infinity
+
+/* all of the above, so that saved results can tell which rules produced them */
+#define Rules \
+  Rule(Unison) Rule(DirectToFifth) Rule(DirectToOctave) Rule(ParallelFifth) \
+  Rule(ParallelUnison) Rule(EndOnPerfect) Rule(NoLeadingTone) Rule(Dissonance) Rule(OutOfRange) \
+  Rule(OutOfMode) Rule(TwoSkips) Rule(DirectMotion) Rule(PerfectConsonance) Rule(Compound) \
+  Rule(TenthToOctave) Rule(SkipTo8ve) Rule(SkipFromUnison) Rule(SkipPrecededBySameDirection) \
+  Rule(FifthPrecededBySameDirection) Rule(SixthPrecededBySameDirection) \
+  Rule(SkipFollowedBySameDirection) Rule(FifthFollowedBySameDirection) \
+  Rule(SixthFollowedBySameDirection) Rule(TwoSkipsNotInTriad) Rule(BadMelody) \
+  Rule(ExtremeRange) Rule(LydianCadentialTritone) Rule(UpperNeighbor) Rule(LowerNeighbor) \
+  Rule(OverTwelfth) Rule(OverOctave) Rule(SixthLeap) Rule(OctaveLeap) Rule(BadCadence) \
+  Rule(DirectPerfectOnDownbeat) Rule(RepetitionOnUpbeat) Rule(DissonanceNotFillingThird) \
+  Rule(UnisonDownbeat) Rule(TwoRepeatedNotes) Rule(ThreeRepeatedNotes) Rule(FourRepeatedNotes) \
+  Rule(LeapAtCadence) Rule(NotaCambiata) Rule(NotBestCadence) Rule(UnisonOnBeat4) \
+  Rule(NotaLigature) Rule(LesserLigature) Rule(UnresolvedLigature) Rule(NoTimeForaLigature) \
+  Rule(EighthJump) Rule(HalfUntied) Rule(UnisonUpbeat) Rule(MelodicBoredom) \
+  Rule(SkipToDownBeat) Rule(ThreeSkips) Rule(DownBeatUnison) Rule(VerticalTritone) \
+  Rule(MelodicTritone) Rule(AscendingSixth) Rule(RepeatedPitch) Rule(NotContraryToOthers) \
+  Rule(NotTriad) Rule(InnerVoicesInDirectToPerfect) Rule(InnerVoicesInDirectToTritone) \
+  Rule(SixFiveChord) Rule(UnpreparedSixFive) Rule(UnresolvedSixFive) Rule(AugmentedInterval) \
+  Rule(ThirdDoubled) Rule(DoubledLeadingTone) Rule(DoubledSixth) Rule(DoubledFifth) \
+  Rule(TripledBass) Rule(UpperVoicesTooFarApart) Rule(UnresolvedLeadingTone) \
+  Rule(AllVoicesSkip) Rule(DirectToTritone) Rule(CrossBelowBass) Rule(CrossAboveCantus) \
+  Rule(NoMotionAgainstOctave) Rule(CantusOverOctave) Rule(TooManySkips) Rule(RepeatedClimax)
+
+#define Rule(Name) Name##Penalty,
+int PenaltyTable[] = {Rules};
+#undef Rule
+
+/* rule numbers, for tallying what each one charged (see ScoreSubmission);
+ * the last few are charged sums rather than fixed penalties
+ */
+#define Rule(Name) Name##Rule,
+enum {Rules SkipSizeRule, PitchRepeatsRule, CrossingRule, NumberOfRules};
+#undef Rule
+
+#define Rule(Name) #Name,
+char *RuleNames[NumberOfRules] = {Rules "SkipSize", "PitchRepeats", "Crossing"};
+#undef Rule
+
+Local int *RuleTally;	/* where the rules add up what they charge, if anywhere */
+
+inline int Tally(int Rule, int Penalty) {if (RuleTally) RuleTally[Rule] += Penalty; return(Penalty);}
+#define Charge(Name) Tally(Name##Rule,Name##Penalty)
+
+Specialized int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other2, int NumParts,
+				    int Species, int MelInt, int Interval, int ActInt, int LastIntClass, int Pitch, int LastMelInt, int CurLim)
 {
   int Val,Above,i,LastDisInt;
   if (Species == 1) return(0);	/* no special rules for 1st species */
@@ -408,11 +534,11 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 	{
 	  if ((Mode != Phrygian) || (Interval >= 0))
 	    {
-	      if (LastIntClass !=  Fifth) Val += BadCadencePenalty;
+	      if (LastIntClass !=  Fifth) Val += Charge(BadCadence);
 	    }
 	  else
 	    {
-	      if (LastIntClass != MinorSixth) Val += BadCadencePenalty;
+	      if (LastIntClass != MinorSixth) Val += Charge(BadCadence);
 	    }
 	}
     }
@@ -420,12 +546,12 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
     {
       if (Species == 4)
 	{
-	  if ((DownBeat(Cn,v)) && (MelInt != Unison)) Val += NotaLigaturePenalty;
+	  if ((DownBeat(Cn,v)) && (MelInt != Unison)) Val += Charge(NotaLigature);
 	  if ((UpBeat(Cn,v)) && (Dissonance[LastIntClass]))
 	    {
-	      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += UnresolvedLigaturePenalty;
-	      if ((ActInt == Unison) && ((Interval<0) || (((ABS(Us(Cn-2,v)-Other2)) % 12) == Unison))) Val += NoTimeForaLigaturePenalty;
-	      if ((ActInt == Fifth) || (ActInt == Tritone)) Val += NoTimeForaLigaturePenalty;
+	      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += Charge(UnresolvedLigature);
+	      if ((ActInt == Unison) && ((Interval<0) || (((ABS(Us(Cn-2,v)-Other2)) % 12) == Unison))) Val += Charge(NoTimeForaLigature);
+	      if ((ActInt == Fifth) || (ActInt == Tritone)) Val += Charge(NoTimeForaLigature);
 	    }
 	}
       else
@@ -433,12 +559,12 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 	  Above=(Interval >= 0);
 	  
 	  /* added check to stop optimizer from changing 4th beat passing tones into repeated notes+skip */
-	  if (((Beat8(Onset[Cn][v]) == 6) || (Beat8(Onset[Cn][v]) == 7)) && (Cp == Us(Cn-1,v))) Val += UnisonOnBeat4Penalty;
+	  if (((Beat8(Onset[Cn][v]) == 6) || (Beat8(Onset[Cn][v]) == 7)) && (Cp == Us(Cn-1,v))) Val += Charge(UnisonOnBeat4);
 	  
 	  /* skip to down beat seems not so great */
 	  if (Beat8(Onset[Cn][v]) == 0)
 	    {
-	      if (ASkip(MelInt)) Val += SkipToDownBeatPenalty;
+	      if (ASkip(MelInt)) Val += Charge(SkipToDownBeat);
 	      if ((Cn>2) && ((ActInt == Unison) || (ActInt == Fifth)))
 		{
 		  if (Species == 5)
@@ -447,7 +573,7 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 		      while ((i>0) && ((Beat8(Onset[i][v])) != 0)) i--;
 		    }
 		  else i=(Cn-4);
-		  if (((ABS(Us(i,v)-Bass(i,v))) % 12) == ActInt) Val += DownBeatUnisonPenalty;
+		  if (((ABS(Us(i,v)-Bass(i,v))) % 12) == ActInt) Val += Charge(DownBeatUnison);
 		}
 	    }
 	  
@@ -456,7 +582,7 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 	      ((AThird(ABS(LastMelInt))) &&
 	       ((Dissonance[(ABS(Us(Cn-2,v)-Other2)) % 12]) &&
 		((MelInt<0) || ((ABS(MelInt) != MajorSecond) && (ABS(MelInt) != MinorSecond))))))
-	    Val += NotaCambiataPenalty;
+	    Val += Charge(NotaCambiata);
 	  if (Val >= CurLim) return(Val);
 	  
 	  if ((Species == 3) && ((Cn>1) && (Dissonance[LastIntClass])))
@@ -464,25 +590,25 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 	      switch (Beat8(Onset[Cn][v]))
 		{
 		case 0: case 6:
-		  if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || ((MelInt*LastMelInt)<0))) Val += DissonancePenalty;
+		  if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || ((MelInt*LastMelInt)<0))) Val += Charge(Dissonance);
 		  break;
 		case 2:
-		  Val += DissonancePenalty;
+		  Val += Charge(Dissonance);
 		  break;
 		case 4:
 		  if ((!(AStep(LastMelInt))) || ((ABS(MelInt)>MajorThird) || ((MelInt == 0) || ((LastMelInt*MelInt)<0))))
-		    Val += DissonancePenalty;
+		    Val += Charge(Dissonance);
 		  else
 		    {
 		      if (!(AStep(MelInt)))
 			{
 			  if (Above)
 			    {
-			      if (!(ASeventh(LastIntClass))) Val += DissonancePenalty;
+			      if (!(ASeventh(LastIntClass))) Val += Charge(Dissonance);
 			    }
 			  else
 			    {
-			      if (LastIntClass != Fourth) Val += DissonancePenalty;
+			      if (LastIntClass != Fourth) Val += Charge(Dissonance);
 			    }
 			}
 		    }
@@ -493,12 +619,12 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 	  if (Species == 5)
 	    {
 	      if ((Cn>1) && ((Beat8(Onset[Cn][v]) == 0) && ((Cp != Us(Cn-1,v)) && (Dur[Cn][v] <= Dur[Cn-1][v]))))
-		Val += LesserLigaturePenalty;
+		Val += Charge(LesserLigature);
 	      if ((Cn>3) && ((Dur[Cn][v] == HalfNote) && ((Beat8(Onset[Cn][v]) == 4) &&
 		  ((Dur[Cn-1][v] == QuarterNote) && (Dur[Cn-2][v] == QuarterNote)))))
-		Val += HalfUntiedPenalty;
+		Val += Charge(HalfUntied);
 	      if ((Dur[Cn][v] == EighthNote) && ((DownBeat(Cn,v)) && (Dissonance[ActInt])))
-		Val += DissonancePenalty;
+		Val += Charge(Dissonance);
 	      if (Val >= CurLim) return(Val);
 	      if (Cn>1) {LastDisInt = ((ABS(Us(Cn-1,v)-Other1)) % 12);}
 	      if ((Cn>1) && (Dissonance[LastDisInt]))
@@ -512,81 +638,110 @@ int SpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other
 			  if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || 
 			      (((MelInt*LastMelInt)<0) || ((Dur[Cn-1][v] == EighthNote) ||
 			       ((Dur[Cn-1][v] == QuarterNote) && (Dur[Cn-2][v] == HalfNote))))))
-			    Val += DissonancePenalty;
+			    Val += Charge(Dissonance);
 			}
 		      break;
 		    case 1: case 3: case 5: case 7:
 		      if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || ((MelInt*LastMelInt)<0)))
-			Val += DissonancePenalty;
+			Val += Charge(Dissonance);
 		      break;
 		    case 0:
-		      if ((Dur[Cn-2][v] == EighthNote) || (Dur[Cn-2][v]<Dur[Cn-1][v])) Val += NoTimeForaLigaturePenalty;
-		      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += UnresolvedLigaturePenalty;
-		      if ((ActInt == Fourth) || (ActInt == Tritone)) Val += NoTimeForaLigaturePenalty;
-		      if ((ActInt == Fifth) && (Interval<0)) Val += NoTimeForaLigaturePenalty;
-		      if ((ActInt == 0) && (((ABS(Us(Cn-2,v)-Other2)) % 12) == 0)) Val += NoTimeForaLigaturePenalty;
-		      if (LastMelInt != Unison) Val += DissonancePenalty;
+		      if ((Dur[Cn-2][v] == EighthNote) || (Dur[Cn-2][v]<Dur[Cn-1][v])) Val += Charge(NoTimeForaLigature);
+		      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += Charge(UnresolvedLigature);
+		      if ((ActInt == Fourth) || (ActInt == Tritone)) Val += Charge(NoTimeForaLigature);
+		      if ((ActInt == Fifth) && (Interval<0)) Val += Charge(NoTimeForaLigature);
+		      if ((ActInt == 0) && (((ABS(Us(Cn-2,v)-Other2)) % 12) == 0)) Val += Charge(NoTimeForaLigature);
+		      if (LastMelInt != Unison) Val += Charge(Dissonance);
 		      break;
 		    case 2:
 		      if ((!(AStep(LastMelInt))) || ((ABS(MelInt)>MajorThird) ||
 			  ((MelInt == 0) || ((Dur[Cn-1][v] == EighthNote) || ((LastMelInt*MelInt)<0)))))
-			Val += DissonancePenalty;
+			Val += Charge(Dissonance);
 		      else
 			{
 			  if (!(AStep(MelInt)))
 			    {
 			      if (Above)
 				{   
-				  if (!(ASeventh(LastIntClass))) Val += DissonancePenalty;
+				  if (!(ASeventh(LastIntClass))) Val += Charge(Dissonance);
 				}
 			      else
 				{
-				  if (LastIntClass != Fourth) Val += DissonancePenalty;
+				  if (LastIntClass != Fourth) Val += Charge(Dissonance);
 				}
 			    }
 			}
 		      break;
 		    }
 		}
-	      if ((Cn>1) && ((Dur[Cn-1][v] == EighthNote) && (!(AStep(MelInt))))) Val += EighthJumpPenalty;
+	      if ((Cn>1) && ((Dur[Cn-1][v] == EighthNote) && (!(AStep(MelInt))))) Val += Charge(EighthJump);
 	      if ((Cn>1) && ((Dur[Cn-1][v] == HalfNote) && ((Beat8(Onset[Cn][v]) == 4) && (MelInt == Unison))))
-		Val += UnisonUpbeatPenalty;
+		Val += Charge(UnisonUpbeat);
 	    }
 	}
     }
   return(Val);
 }
 
-#define INTERVALS_WITH_BASS_SIZE 8
-int IntervalsWithBass[INTERVALS_WITH_BASS_SIZE];
-    /* 0 = octave, 2 = step, 3 = third, 4 = fourth, 5 = fifth, 6 = sixth, 7 = seventh */
+/* OtherVoiceCheck keeps the chord above the bass as a count of each
+ * interval class in 3 bits of Chord (there are at most MostVoices tones):
+ * the octaves, thirds, fifths and sixths, which are all the chord rules look
+ * at, come first, so that Chord & ChordKey is all ChordRules needs, then the
+ * steps, fourths and sevenths.  ChordClasses is indexed by an interval % 12,
+ * plus 11 since a voice below the bass gives one < 0.
+ */
+enum {ChordOctave, ChordThird, ChordFifth, ChordSixth, ChordStep, ChordFourth, ChordSeventh};
+int ChordClasses[23] = {4,4,1,1,5,5,2,3,3,6,6, 0, 4,4,1,1,5,5,2,3,3,6,6};
+#define ChordTone(n) (1 << (3*ChordClasses[((n) % 12)+11]))
+#define ChordCount(Chord,Class) (((Chord) >> (3*(Class))) & 7)
+#define ChordHas(Chord,Class) ((Chord) & (7 << (3*(Class))))
+#define ChordKey 07777
+
+/* The chord rules: what the chord's tones above the bass cost, whatever the
+ * voices did to get there.  Triad is set if the chord must have a third or a
+ * sixth (the last voice's check, not at the last note).  ChordTable holds
+ * their sums for every ChordKey of Chord, Triad and fifth species or not, so
+ * that OtherVoiceCheck (when not tallying) looks them up instead; it is
+ * built with MelodyTable (see TablesReady).
+ */
 
-void AddInterval(int n)
+inline int ChordRules(int Chord, int Triad, int Species)
 {
-  int ActInt;
-  switch (n % 12)
-    {
-    case 0: ActInt = 0; break;
-    case 1: case 2: ActInt = 2; break;
-    case 3: case 4: ActInt = 3; break;
-    case 5: case 6: ActInt = 4; break;
-    case 7: ActInt = 5; break;
-    case 8: case 9: ActInt = 6; break;
-    case 10: case 11: ActInt = 7; break;
-    }
-  IntervalsWithBass[ActInt]++;
+  int Val;
+  Val=0;
+
+  /* check for doubled third */
+  if (ChordCount(Chord,ChordThird)>1) Val += Charge(ThirdDoubled);
+
+  /* check for doubled sixth */
+  if ((!(ChordHas(Chord,ChordThird))) && (ChordCount(Chord,ChordSixth)>1)) Val += Charge(DoubledSixth);
+  
+  /* check for too many voices at octaves */
+  if (ChordCount(Chord,ChordOctave)>2) Val += Charge(TripledBass);
+
+  /* check for doubled fifth */
+  if (ChordCount(Chord,ChordFifth)>1) Val += Charge(DoubledFifth);
+
+  /* check that chord contains at least one third or sixth */
+  if ((Triad) && (!(ChordHas(Chord,ChordThird) | ChordHas(Chord,ChordSixth)))) Val += Charge(NotTriad);
+  
+  /* except in 5th species, disallow 6-5 chords altogether */
+  if ((ChordHas(Chord,ChordFifth)) && ((ChordHas(Chord,ChordSixth)) && (Species != 5))) Val += Charge(SixFiveChord);
+  return(Val);
 }
 
-int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+int ChordTable[4][ChordKey+1];		/* [Triad+(2*(Species == 5))] */
+Local int UseTables;			/* set by SpecializeCheck once the tables are built */
+
+Specialized int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
 {
-  int Val,k,CurBass,Other0,Other1,Int0,Int1,ActPitch,IntBass,LastCp,AllSkip,i,ourLastInt;
+  int Val,k,CurBass,Other0,Other1,Int0,Int1,ActPitch,IntBass,LastCp,AllSkip,ourLastInt,Chord,Triad;
   if (v == 1) return(0);	/* two part or bass voice, so nothing to check */
-  for (i=0;i<INTERVALS_WITH_BASS_SIZE;i++) IntervalsWithBass[i]=0;
   Val=0;
   CurBass=Bass(Cn,v);
-  if (Cp <= CurBass) Val += CrossBelowBassPenalty;
+  if (Cp <= CurBass) Val += Charge(CrossBelowBass);
   IntBass=((Cp-CurBass) % 12);
-  if ((IntBass == MajorThird) && (!(InMode(CurBass,Mode)))) Val += AugmentedIntervalPenalty;
+  if ((IntBass == MajorThird) && (!(InMode(CurBass,Mode)))) Val += Charge(AugmentedInterval);
   ActPitch=(Cp % 12);
   
   if ((Val >= CurLim) || ((v == NumParts) && (Dissonance[IntBass]))) return(Val);
@@ -596,34 +751,34 @@ int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim
      */
   LastCp=Us(Cn-1,v);
   AllSkip=ASkip(Cp-LastCp);
-  AddInterval(IntBass);
+  Chord=ChordTone(IntBass);
   for (k=0;k<v;k++)
     {
       Other0=Other(Cn,v,k);
       Other1=Other(Cn-1,v,k);
       if (!(ASkip(Other0-Other1))) AllSkip=0;
-      AddInterval(Other0-CurBass);	/* add up tones in chord */
+      Chord += ChordTone(Other0-CurBass);	/* add up tones in chord */
       /* avoid unison with other voice */
-      if ((!(LastNote(Cn,v))) && (Other0 == Cp)) Val += UnisonPenalty;
+      if ((!(LastNote(Cn,v))) && (Other0 == Cp)) Val += Charge(Unison);
 
       /* keep upper voices closer together than lower */
-      if ((Other0 != CurBass) && ((ABS(Cp-Other0)) >= (Octave+Fifth))) Val += UpperVoicesTooFarApartPenalty;
+      if ((Other0 != CurBass) && ((ABS(Cp-Other0)) >= (Octave+Fifth))) Val += Charge(UpperVoicesTooFarApart);
 
       /* check for direct motion to perfect consonance between these two voices */
       Int0=((ABS(Other0-Cp)) % 12);
       Int1=((ABS(Other1-LastCp)) % 12);
       if (Int1 == Int0)
 	{
-          if (Int0 == Unison) Val += ParallelUnisonPenalty;
-	  else if (Int0 == Fifth) Val += ParallelFifthPenalty;
+          if (Int0 == Unison) Val += Charge(ParallelUnison);
+	  else if (Int0 == Fifth) Val += Charge(ParallelFifth);
 	}
       if ((Cn>2) && ((Int0 == Unison) && (((ABS(Us(Cn-2,v)-Other(Cn-2,v,k))) % 12) == Unison)))
-        Val += ParallelUnisonPenalty;
+        Val += Charge(ParallelUnison);
 
       if (Val >= CurLim) return(Val);
 
       /* penalize tritones between voices */
-      if (Int0 == Tritone) Val += VerticalTritonePenalty;
+      if (Int0 == Tritone) Val += Charge(VerticalTritone);
 
       if (Species == 5)
 	{
@@ -634,11 +789,11 @@ int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim
 		{
                   if (ourLastInt == Fifth)
 		    {
-                      if ((ASkip(Cp-LastCp)) || (Cp >= LastCp)) Val += UnresolvedSixFivePenalty;
+                      if ((ASkip(Cp-LastCp)) || (Cp >= LastCp)) Val += Charge(UnresolvedSixFive);
 		    }
 		  else
 		    {
-		      if ((ASkip(Other0-Other1)) || (Other0 >= Other1)) Val += UnresolvedSixFivePenalty;
+		      if ((ASkip(Other0-Other1)) || (Other0 >= Other1)) Val += Charge(UnresolvedSixFive);
 		    }
 		}
 	    }
@@ -646,13 +801,13 @@ int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim
 	    {
               if ((IntBass == Fifth && ((Cp-LastCp) != Unison)) ||
 		  ((IntBass != Fifth) && ((Other0-Other1) != Unison)))
-		Val += UnpreparedSixFivePenalty;
+		Val += Charge(UnpreparedSixFive);
 	    }
 	}
 
       /* penalize direct motion to perfect consonance except at the cadence */
       if ((!(LastNote(Cn,v))) && (DirectMotionToPerfectConsonance(LastCp,Cp,Other1,Other0)))
-	Val += InnerVoicesInDirectToPerfectPenalty;
+	Val += Charge(InnerVoicesInDirectToPerfect);
 
       /* if we have an unraised leading tone it is possible that some other
        * voice has the raised form thereof (since the voices can move at very
@@ -661,50 +816,224 @@ int OtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim
        */
       if ((ActPitch == 10) &&	 	        /* if 11 we've aready checked */
 	  ((Other0 % 12) == 11))		/* They have the raised form */
-        Val += DoubledLeadingTonePenalty;
+        Val += Charge(DoubledLeadingTone);
 
       /* similarly for motion to a tritone */
       if ((MotionType(LastCp,Cp,Other1,Other0) == DirectMotion) && (Int0 == Tritone))
-        Val += InnerVoicesInDirectToTritonePenalty;
+        Val += Charge(InnerVoicesInDirectToTritone);
 
       /* look for a common diminished fourth (when a raised leading tone is in 
        * the bass, a "major third" above it is actually a diminished fourth.
        * Similarly, an augmented fifth can be formed in other cases 
        */
-      if ((ActPitch == 3) && ((Other0 % 12) == 11)) Val += AugmentedIntervalPenalty;
+      if ((ActPitch == 3) && ((Other0 % 12) == 11)) Val += Charge(AugmentedInterval);
 
       /* try to encourage voices not to move in parallel too much */
-      if (MotionType(LastCp,Cp,Other1,Other0) != ContraryMotion) Val += NotContraryToOthersPenalty;
+      if (MotionType(LastCp,Cp,Other1,Other0) != ContraryMotion) Val += Charge(NotContraryToOthers);
     }
 
-  /* check for doubled third */
-  if (IntervalsWithBass[3]>1) Val += ThirdDoubledPenalty;
+  Triad=((v == NumParts) && (!(LastNote(Cn,v))));
+  if ((UseTables) && (!(RuleTally))) Val += ChordTable[Triad+(2*(Species == 5))][Chord & ChordKey];
+  else Val += ChordRules(Chord,Triad,Species);
 
-  /* check for doubled sixth */
-  if ((IntervalsWithBass[3] == 0) && (IntervalsWithBass[6]>1)) Val += DoubledSixthPenalty;
-  
-  /* check for too many voices at octaves */
-  if (IntervalsWithBass[0]>2) Val += TripledBassPenalty;
+  /* discourage all voices from skipping at once */
+  if ((v == NumParts) && AllSkip) Val += Charge(AllVoicesSkip);
+  return(Val);
+}
 
-  /* check for doubled fifth */
-  if (IntervalsWithBass[5]>1) Val += DoubledFifthPenalty;
+/* The rules CheckRules applies are grouped into clauses, each charging one
+ * or a few closely related rules.  A clause is Hard if it can charge
+ * infinity (and so reject a note outright), and its Cost is roughly what it
+ * takes to evaluate (1 = arithmetic, 2 = a call or short loop, 3 = a loop
+ * over the voice or the other voices).  CheckRules runs them in ClauseOrder,
+ * giving up as soon as the penalty reaches its limit, so the order changes
+ * how soon a bad note is dropped but never the penalty of a note that is
+ * kept.  The table is in the default order: hard clauses first, cheapest
+ * first, then the soft ones the same way.  The clauses marked First also
+ * apply to a voice's first note.
+ */
 
-  /* check that chord contains at least one third or sixth */
-  if ((v == NumParts) && ((!(LastNote(Cn,v))) && ((IntervalsWithBass[3] == 0) && (IntervalsWithBass[6] == 0))))
-    Val += NotTriadPenalty;
-  
-  /* discourage all voices from skipping at once */
-  if ((v == NumParts) && AllSkip) Val += AllVoicesSkipPenalty;
-  
-  /* except in 5th species, disallow 6-5 chords altogether */
-  if ((IntervalsWithBass[5]>0) && ((IntervalsWithBass[6]>0) && (Species != 5))) Val += SixFiveChordPenalty;
+#define Hard 1
+#define Soft 0
+
+#define Clauses \
+  Clause(Mode,Hard,1,1) \
+  Clause(CrossAboveCantus,Hard,1,1) \
+  Clause(Parallel,Hard,1,0) \
+  Clause(Melody,Hard,1,0) \
+  Clause(EndOnPerfect,Hard,1,0) \
+  Clause(UnresolvedLeadingTone,Hard,1,0) \
+  Clause(Augmented,Hard,1,0) \
+  Clause(Downbeat,Hard,1,0) \
+  Clause(Dissonance,Hard,2,1) \
+  Clause(SpecialSpecies,Hard,2,1) \
+  Clause(OverTwelfth,Hard,3,0) \
+  Clause(OtherVoice,Hard,3,1) \
+  Clause(Range,Soft,1,1) \
+  Clause(DirectToPerfect,Soft,1,0) \
+  Clause(NoMotion,Soft,1,0) \
+  Clause(DirectMotion,Soft,1,0) \
+  Clause(Compound,Soft,1,0) \
+  Clause(SkipToOctave,Soft,1,0) \
+  Clause(MelodicTritone,Soft,1,0) \
+  Clause(TenthToOctave,Soft,1,0) \
+  Clause(RepeatedNotes,Soft,1,0) \
+  Clause(PerfectConsonance,Soft,1,0) \
+  Clause(LeapAtCadence,Soft,1,0) \
+  Clause(RepetitionOnUpbeat,Soft,1,0) \
+  Clause(LydianCadence,Soft,1,0) \
+  Clause(VerticalTritone,Soft,1,0) \
+  Clause(PitchRepeats,Soft,2,0) \
+  Clause(Crossing,Soft,3,0) \
+  Clause(IntervalVariety,Soft,3,0)
+
+#define Clause(Name,Kind,Cost,First) Name##Clause,
+enum {Clauses NumberOfClauses};
+Local int ClauseOrder[NumberOfClauses] = {Clauses};	/* each thread's own (see FinishTuning) */
+#undef Clause
+
+typedef struct {char *Name; int Kind, Cost, First;} ClauseInfo;
+#define Clause(Name,Kind,Cost,First) {#Name, Kind, Cost, First},
+ClauseInfo ClauseTable[NumberOfClauses] = {Clauses};
+#undef Clause
+
+Local int FirstClauseOrder[NumberOfClauses] =	/* ClauseOrder less the clauses that skip first notes */
+  {ModeClause, CrossAboveCantusClause, DissonanceClause, SpecialSpeciesClause, OtherVoiceClause, RangeClause};
+Local int FirstClauses = 6;
+
+/* The Melody clause charges the rules that look only at the voice's last
+ * three melodic intervals (MelInt, then LastMelInt, then Int3, the one before
+ * that) and at how many of them there are.  MelodyRules charges them one by
+ * one; MelodyTable holds their sums for every interval up to an octave, so
+ * that the search (though not the scoring, which tallies them) looks the
+ * sum up instead (see TablesReady).  An entry of -1 (anything charging
+ * BadMelody) sends it back to MelodyRules.
+ */
+
+inline int MelodyRules(int Cn, int MelInt, int LastMelInt, int Int3)
+{
+  int Val,SameDir,totalJump;
+  Val=0;
+  SameDir=((MelInt*LastMelInt) >= 0);
+
+  /* certain melodic intervals are disallowed */
+  if (BadMelody(MelInt)) Val += Charge(BadMelody);
+
+  /* penalize consecutive skips in the same direction */
+  if ((Cn>2) && (ConsecutiveSkipsInSameDirection(0,LastMelInt,LastMelInt+MelInt)))
+    {
+      Val += Charge(TwoSkips);
+      totalJump=ABS(MelInt+LastMelInt);
+
+      /* do not let these skips traverse more than an octave, nor a seventh */
+      if ((totalJump > MajorSixth) && (totalJump < Octave)) Val += Charge(TwoSkipsNotInTriad);
+    }
+
+  /* penalize skips followed or preceded by motion in same direction */
+  if ((Cn>2) && ((ASkip(MelInt)) && SameDir))
+    {
+      /* especially penalize fifths, sixths, and octaves of this sort */
+      if ((ABS(MelInt)) < Fifth) Val += Charge(SkipPrecededBySameDirection);
+      else
+	{
+	  if (((ABS(MelInt)) == Fifth) || ((ABS(MelInt)) == Octave)) 
+	    Val += Charge(FifthPrecededBySameDirection);
+	  else Val += Charge(SixthPrecededBySameDirection);
+	}
+    }
+  if ((Cn>2) && ((ASkip(LastMelInt)) && SameDir))
+    {
+      if ((ABS(LastMelInt)) < Fifth) Val += Charge(SkipFollowedBySameDirection);
+      else
+	{
+	  if (((ABS(LastMelInt)) == Fifth) || ((ABS(LastMelInt)) == Octave))
+	    Val += Charge(FifthFollowedBySameDirection);
+	  else Val += Charge(SixthFollowedBySameDirection);
+	}
+    }
+
+  /* too many skips in a row -- favor a mix of steps and skips */
+  if ((Cn>4) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (ASkip(Int3))))) Val += Charge(MelodicBoredom);
+
+  /* more range checks -- did we go over an octave recently */
+  if ((Cn>2) && ((ABS(MelInt+LastMelInt)) > Octave)) Val += Charge(OverOctave);
+
+  /* slightly penalize repeated notes (the longer repeats are the RepeatedNotes clause's) */
+  if ((Cn>3) && (((MelInt+LastMelInt) == 0) && ((LastMelInt+Int3) == 0))) Val += Charge(TwoRepeatedNotes);
+
+  /* penalize octave leaps a little */
+  if (AnOctave(MelInt)) Val += Charge(OctaveLeap);
+
+  /* similarly for minor sixth leaps */
+  if (MelInt == MinorSixth) Val += Charge(SixthLeap);
+
+  /* penalize upper neighbor notes slightly (also lower neighbors) */
+  if ((Cn>2) && ((MelInt<0) && ((AStep(MelInt)) && ((MelInt+LastMelInt) == 0)))) Val += Charge(UpperNeighbor);
+  if ((Cn>2) && ((MelInt>0) && ((AStep(MelInt)) && ((MelInt+LastMelInt) == 0)))) Val += Charge(LowerNeighbor);
+
+  /* slightly frown upon leap back in the opposite direction */
+  if ((Cn>2) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (!(SameDir)))))
+    {
+      Val += Tally(SkipSizeRule,MAX(0,((ABS(MelInt)+ABS(LastMelInt))-8)));
+      if ((Cn>3) && (ASkip(Int3))) Val += Charge(ThreeSkips);
+    }
   return(Val);
 }
 
-int Check(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+#define MelodySpan (2*Octave+1)
+#define MelodyIndex(Cn,MelInt,LastMelInt,Int3) \
+  ((((((MIN(Cn,5)-2)*MelodySpan)+(MelInt+Octave))*MelodySpan+(LastMelInt+Octave))*MelodySpan)+(Int3+Octave))
+
+short MelodyTable[4*MelodySpan*MelodySpan*MelodySpan];
+
+void BuildTables()
 {
-  int Val,k,Interval,IntClass,Pitch,LastIntClass,MelInt,LastMelInt,Other0,Other1,Other2;
-  int Cross,SameDir,WeHaveARealLeadingTone,LastPitch,totalJump,LastCp,LastCp2,LastCp3,LastCp4;
+  int Cn,m,l,t,p,*Tallying;
+  Tallying=RuleTally;
+  RuleTally=NULL;
+  for (p=0;p<=ChordKey;p++)
+    for (t=0;t<4;t++) ChordTable[t][p]=ChordRules(p,t & 1,((t & 2) ? 5 : 1));
+  for (Cn=2;Cn<=5;Cn++)
+    for (m=-Octave;m<=Octave;m++)
+      for (l=-Octave;l<=Octave;l++)
+	for (t=-Octave;t<=Octave;t++)
+	  {
+	    p=MelodyRules(Cn,m,((Cn>2) ? l : 0),((Cn>3) ? t : 0));
+	    MelodyTable[MelodyIndex(Cn,m,l,t)]=((p < infinity) ? p : -1);
+	  }
+  RuleTally=Tallying;
+}
+
+#ifdef THREADS
+pthread_once_t TablesOnce = PTHREAD_ONCE_INIT;
+void TablesReady() {pthread_once(&TablesOnce,BuildTables);}
+#else
+int TablesBuilt = 0;
+void TablesReady() {if (!(TablesBuilt)) {BuildTables(); TablesBuilt=1;}}
+#endif
+
+inline int Melody(int Cn, int MelInt, int LastMelInt, int Int3)
+{
+  int p;
+  if ((UseTables) && (!(RuleTally)) && (((unsigned)(MelInt+Octave)) < MelodySpan) &&
+      (((unsigned)(LastMelInt+Octave)) < MelodySpan) && (((unsigned)(Int3+Octave)) < MelodySpan))
+    {
+      p=MelodyTable[MelodyIndex(Cn,MelInt,LastMelInt,Int3)];
+      if (p >= 0) return(p);
+    }
+  return(MelodyRules(Cn,MelInt,LastMelInt,Int3));
+}
+
+/* Tuning (see StartTuning) counts where each check stopped */
+Local int TuningClauses;
+Local long ClauseExits[NumberOfClauses+1];	/* by position in ClauseOrder, NumberOfClauses = ran them all */
+
+Specialized int CheckRules(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+{
+  int Val,i,k,Count,Interval,IntClass,Pitch,LastIntClass,MelInt,LastMelInt,Other0,Other1,Other2;
+  int Cross,SameDir,WeHaveARealLeadingTone,LastPitch,LastCp,LastCp2,LastCp3,LastCp4;
+  int *Order;
+  Other2=0; LastMelInt=0; SameDir=1; LastIntClass=0;	/* until there are 3 notes */
   if (v == 1)
     {
       Other0=Cantus(Cn,v);
@@ -724,55 +1053,6 @@ int Check(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
   IntClass=(ABS(Interval)) % 12;
   MelInt=(Cp-LastCp);
   Pitch=(Cp % 12);
-
-  /* melody must stay in range */
-  if (OutOfRange(Cp+BasePitch)) Val += OutOfRangePenalty;
-
-  /* extremes of range are also bad (to be avoided) */
-  if (ExtremeRange(Cp+BasePitch)) Val += ExtremeRangePenalty;
-
-  /* two part with ctrpt below cantus -- keep it below */
-  if ((NumParts == 1) && ((Us(1,v) < Cantus(1,v)) && (Interval > Unison))) Val += CrossAboveCantusPenalty;
-
-  /* Chromatically altered notes are accepted only at the cadence.  Other alterations (such as ficta) will be handled later) */
-  if (!(NextToLastNote(Cn,v)))
-    {
-      if (Species != 2)
-	{
-	  if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
-	}
-      else
-	{
-	  if ((Cn != TotalNotes[v]-2) || ((Mode != Aeolian) || ((Cp <= Other0) || (IntClass != Fifth))))
-	    {
-              if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
-	    }
-	}
-    }
-  else
-    {
-      WeHaveARealLeadingTone = ((Pitch == 11) || ((Pitch == 10) && (Mode == Phrygian)));
-      if (WeHaveARealLeadingTone)
-	{
-	  if (Doubled(Pitch,Cn,v)) Val += DoubledLeadingTonePenalty;
-	}
-      else
-	{
-	  if (Pitch == 10) Val += BadCadencePenalty;
-	  else
-	    {
-	      if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
-	      else
-		{
-		  if (v == NumParts)
-		    {
-		      if ((!(Doubled(11,Cn,v))) && (!(Doubled(10,Cn,v)))) Val += NoLeadingTonePenalty;
-		    }
-		}
-	    }
-	}
-    }
-  if (Val >= CurLim) return(Val);
   if (Cn>2)
     {
       LastCp2=Us(Cn-2,v);
@@ -785,551 +1065,3476 @@ int Check(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
       SameDir=((MelInt*LastMelInt) >= 0);
     }
   if (Cn>1) {LastIntClass=((ABS(LastCp-Other1)) % 12);}
-  if (ADissonance(IntClass,Cn,Cp,v,Species)) Val += DissonancePenalty;
-  if (Val >= CurLim) return(Val);
-  Val += SpecialSpeciesCheck(Cn,Cp,v,Other0,Other1,Other2,NumParts,Species,MelInt,Interval,IntClass,LastIntClass,Pitch,LastMelInt,CurLim);
-  if (v>1) Val += OtherVoiceCheck(Cn,Cp,v,NumParts,Species,CurLim);
-  if (FirstNote(Cn,v)) return(Val);
-  /* no further rules apply to first note */
-  if (Val >= CurLim) return(Val);
 
-  /* direct motion to perfect consonances considered harmful */
-  if ((!(LastNote(Cn,v))) || (NumParts == 1))
+  /* no rules after the First ones apply to first note */
+  if (FirstNote(Cn,v)) {Order=FirstClauseOrder; Count=FirstClauses;} else {Order=ClauseOrder; Count=NumberOfClauses;}
+  for (i=0;i<Count;i++)
     {
-      if (DirectMotionToPerfectConsonance(LastCp,Cp,Other1,Other0))
+      switch (Order[i])
 	{
-	  if (IntClass == Unison) Val += DirectToOctavePenalty;
-	  else Val += DirectToFifthPenalty;
-	}
-    }
-
-  /* check for more blatant examples of the same error */
+	case RangeClause:
+	  /* melody must stay in range */
+	  if (OutOfRange(Cp+BasePitch)) Val += Charge(OutOfRange);
+
+	  /* extremes of range are also bad (to be avoided) */
+	  if (ExtremeRange(Cp+BasePitch)) Val += Charge(ExtremeRange);
+	  break;
+
+	case CrossAboveCantusClause:
+	  /* two part with ctrpt below cantus -- keep it below */
+	  if ((NumParts == 1) && (((NotesBefore[v]) ? CarriedBelow[v] : (Us(1,v) < Cantus(1,v))) && (Interval > Unison))) Val += Charge(CrossAboveCantus);
+	  break;
+
+	case ModeClause:
+	  /* Chromatically altered notes are accepted only at the cadence.  Other alterations (such as ficta) will be handled later) */
+	  if (!(NextToLastNote(Cn,v)))
+	    {
+	      if (Species != 2)
+		{
+		  if (!(InMode(Pitch,Mode))) Val += Charge(OutOfMode);
+		}
+	      else
+		{
+		  if ((Cn != EndNotes[v]-2) || ((Mode != Aeolian) || ((Cp <= Other0) || (IntClass != Fifth))))
+		    {
+		      if (!(InMode(Pitch,Mode))) Val += Charge(OutOfMode);
+		    }
+		}
+	    }
+	  else
+	    {
+	      WeHaveARealLeadingTone = ((Pitch == 11) || ((Pitch == 10) && (Mode == Phrygian)));
+	      if (WeHaveARealLeadingTone)
+		{
+		  if (Doubled(Pitch,Cn,v)) Val += Charge(DoubledLeadingTone);
+		}
+	      else
+		{
+		  if (Pitch == 10) Val += Charge(BadCadence);
+		  else
+		    {
+		      if (!(InMode(Pitch,Mode))) Val += Charge(OutOfMode);
+		      else
+			{
+			  if (v == NumParts)
+			    {
+			      if (!(Sounding(Cn,v) & ((1 << 11) | (1 << 10)))) Val += Charge(NoLeadingTone);
+			    }
+			}
+		    }
+		}
+	    }
+	  break;
+
+	case DissonanceClause:
+	  if (ADissonance(IntClass,Cn,Cp,v,Species)) Val += Charge(Dissonance);
+	  break;
+
+	case SpecialSpeciesClause:
+	  Val += SpecialSpeciesCheck(Cn,Cp,v,Other0,Other1,Other2,NumParts,Species,MelInt,Interval,IntClass,LastIntClass,Pitch,LastMelInt,CurLim-Val);
+	  break;
+
+	case OtherVoiceClause:
+	  if (v>1) Val += OtherVoiceCheck(Cn,Cp,v,NumParts,Species,CurLim-Val);
+	  break;
+
+	case DirectToPerfectClause:
+	  /* direct motion to perfect consonances considered harmful */
+	  if ((!(LastNote(Cn,v))) || (NumParts == 1))
+	    {
+	      if (DirectMotionToPerfectConsonance(LastCp,Cp,Other1,Other0))
+		{
+		  if (IntClass == Unison) Val += Charge(DirectToOctave);
+		  else Val += Charge(DirectToFifth);
+		}
+	    }
+	  break;
+
+	case ParallelClause:
+	  /* check for more blatant examples of the same error */
+	  if ((IntClass == Fifth) && (LastIntClass == Fifth)) Val += Charge(ParallelFifth);
+	  if ((IntClass == Unison) && (LastIntClass == Unison)) Val += Charge(ParallelUnison);
+	  break;
+
+	case NoMotionClause:
+	  if ((Cn>1) && ((Species == 1) && ((NumParts == 1) && ((IntClass == LastIntClass) && (MelInt == Unison)))))
+	    Val += Charge(NoMotionAgainstOctave);
+	  break;
+
+	case MelodyClause:
+	  Val += Melody(Cn,MelInt,LastMelInt,((Cn>3) ? (LastCp2-LastCp3) : 0));
+	  break;
+
+	case EndOnPerfectClause:
+	  /* must end on unison or octave in two parts, fifth and major third allowed in 3 and 4 part writing */
+	  if ((LastNote(Cn,v)) && (IntClass != Unison))
+	    {
+	      if ((NumParts == 1) || (Interval<0)) Val += Charge(EndOnPerfect);
+	      else
+		{
+		  if ((IntClass != Fifth) && (IntClass != MajorThird)) Val += Charge(EndOnPerfect);
+		}
+	    }
+	  break;
+
+	case DirectMotionClause:
+	  /* penalize direct motion any kind (contrary motion is better) */
+	  if (MotionType(LastCp,Cp,Other1,Other0) == DirectMotion)
+	    {
+	      Val += Charge(DirectMotion);
+	      if (IntClass == Tritone) Val += Charge(DirectToFifth);
+	    }
+	  break;
+
+	case CompoundClause:
+	  /* penalize compound intervals (close position is favored) */
+	  if ((ABS(Interval))>Octave) Val += Charge(Compound);
+	  break;
+
+	case SkipToOctaveClause:
+	  /* penalize a skip to an octave */
+	  if ((IntClass == Unison) && ((ASkip(MelInt)) || (ASkip(Other0-Other1)))) Val += Charge(SkipTo8ve);
+
+	  /* do not skip from a unison (not a very important rule) */
+	  if ((Other1 == LastCp) && (ASkip(MelInt))) Val += Charge(SkipFromUnison);
+	  break;
+
+	case MelodicTritoneClause:
+	  /* avoid tritones melodically */
+	  if ((Cn>4) && (((ABS(Cp-LastCp2)) == Tritone) || (((ABS(Cp-LastCp3)) == Tritone) || ((ABS(Cp-LastCp4)) == Tritone))))
+	    Val += Charge(MelodicTritone);
+	  break;
+
+	case TenthToOctaveClause:
+	  /* do not allow movement from a tenth to an octave by contrary motion */
+	  if ((Species != 5) && (NumParts == 1))
+	    {
+	      if (ATenth(Other1-LastCp) && (AnOctave(Interval))) Val += Charge(TenthToOctave);
+	    }
+	  break;
+
+	case OverTwelfthClause:
+	  /* same for a twelfth */
+	  if ((((Cn+NotesBefore[v])>30) || (Species != 5)) && (TotalRange(Cn,Cp,v) > (Octave+Fifth))) Val += Charge(OverTwelfth);
+	  break;
+
+	case RepeatedNotesClause:
+	  /* slightly penalize repeated notes */
+	  if ((Cn>5) && ((Cp == LastCp3) && ((LastCp == LastCp4) && (LastCp2 == Us(Cn-5,v))))) Val += Charge(ThreeRepeatedNotes);
+	  if ((Cn>6) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) && (LastCp2 == Us(Cn-6,v))))) Val += Tally(ThreeRepeatedNotesRule,ThreeRepeatedNotesPenalty-1);
+	  if ((Cn>7) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) &&
+	       ((LastCp2 == Us(Cn-6,v)) && (LastCp3 == Us(Cn-7,v)))))) Val += Charge(FourRepeatedNotes);
+	  if ((Cn>8) && ((Cp == Us(Cn-5,v)) && ((LastCp == Us(Cn-6,v)) &&
+	      ((LastCp2 == Us(Cn-7,v)) && (LastCp3 == Us(Cn-8,v)))))) Val += Charge(FourRepeatedNotes);
+	  break;
+
+	case UnresolvedLeadingToneClause:
+	  if (LastNote(Cn,v))
+	    {
+	      LastPitch=(LastCp % 12);
+	      if (((LastPitch == 11) || ((LastPitch == 10) && (Mode == Phrygian))) && (Pitch != 0)) Val += Charge(UnresolvedLeadingTone);
+	    }
+	  break;
+
+	case PerfectConsonanceClause:
+	  /* an imperfect consonance is better than a perfect consonance */
+	  if (PerfectConsonance[IntClass]) Val += Charge(PerfectConsonance);
+
+	  /* no unisons allowed within counterpoint unless more than 2 parts */
+	  if ((NumParts == 1) && (Interval == Unison)) Val += Charge(Unison);
+	  break;
+
+	case PitchRepeatsClause:
+	  /* seek variety by avoiding pitch repetitions */
+	  Val += Tally(PitchRepeatsRule,PitchRepeats(Cn,Cp,v)>>1);
+	  break;
+
+	case AugmentedClause:
+	  /* do not allow normal leading tone to precede raised leading tone */
+	  /* also check here for augmented fifths and diminished fourths */
+	  if ((!(InMode(Pitch,Mode))) && ((MelInt == MinorSecond) || ((MelInt == MinorSixth) || (MelInt == (-MajorThird))))) Val += Charge(OutOfMode);   
+	  break;
+
+	case LeapAtCadenceClause:
+	  /* try to approach cadential passages by step */
+	  if ((NumParts == 1) && ((Cn >= (EndNotes[v]-4)) && ((ABS(MelInt)) > 4))) Val += Charge(LeapAtCadence);
+	  break;
+
+	case CrossingClause:
+	  /* check for entangled voices */
+	  Cross=CarriedCross[v];
+	  if (NumParts == 1)
+	    {
+	      for (k=4;k<Cn;k++)
+		{
+		  if ((Us(k,v)-Cantus(k,v))*(Us(k-1,v)-Cantus(k-1,v)) < 0) Cross++;
+		}
+	      if ((Cn>=4) && (((Cp-Other0)*(LastCp-Other1)) < 0)) Cross++;	/* Us(Cn,v) isn't Cp yet */
+	    }
+	  if (Cross > 0) Val += Tally(CrossingRule,MAX(0,((Cross-2)*3)));
+	  break;
+
+	case RepetitionOnUpbeatClause:
+	  /* don't repeat note on upbeat */
+	  if (UpBeat(Cn,v) && (MelInt == Unison)) Val += Charge(RepetitionOnUpbeat);
+	  break;
+
+	case LydianCadenceClause:
+	  /* avoid tritones near Lydian cadence */
+	  if ((Mode == Lydian) && ((Cn>(EndNotes[v]-4)) && (Pitch == 6))) Val += Charge(LydianCadentialTritone);
+	  break;
+
+	case DownbeatClause:
+	  /* various miscellaneous checks.  More elaborate dissonance resolution and cadential formula checks will be given under "Species definition" */
+	  if ((Species != 1) && (DownBeat(Cn,v)))
+	    {
+	      if (Species<4)
+		{
+		  if ((MelInt == Unison) && (!(LastNote(Cn,v)))) Val += Charge(UnisonDownbeat);
+		  /* check for dissonance that doesn't fill a third as a passing tone */
+		  if ((Dissonance[LastIntClass]) && ((!(AStep(MelInt))) || (!(SameDir)))) Val += Charge(DissonanceNotFillingThird);
+		}
+
+	      /* check for Direct 8ve or 5 where the intervening interval is less than a fourth */
+	      if ((DirectMotionToPerfectConsonance(LastCp2,Cp,Other2,Other0)) && ((ABS(LastMelInt)) < Fourth))
+		Val += Charge(DirectPerfectOnDownbeat);
+	    }
+	  break;
+
+	case VerticalTritoneClause:
+	  /* check for tritone with cantus or bass */
+	  if (IntClass == Tritone) Val += Charge(VerticalTritone);
+	  break;
+
+	case IntervalVarietyClause:
+	  /* check for melodic interval variety */
+	  if (((Cn+NotesBefore[v])>10) && (TooMuchOfInterval(Cn,Cp,v))) Val += Charge(MelodicBoredom);
+	  break;
+	}
+      if (Val >= CurLim)
+	{
+	  if ((TuningClauses) && (Order == ClauseOrder)) ClauseExits[i]++;
+	  return(Val);
+	}
+    }
+  if ((TuningClauses) && (Order == ClauseOrder)) ClauseExits[NumberOfClauses]++;
+  return(Val);
+}
+
+/* Species and NumParts are fixed for a whole solve (inner voices are always
+ * first species), so the search calls a copy of CheckRules compiled for that
+ * combination, picked once per solve by SpecializeCheck.  The bass (v == 1)
+ * gets its own copy so that the cantus/bass choice folds away too.
+ */
+
+typedef int (*CheckFunction)(int Cn, int Cp, int v, int CurLim);
+
+#define Checker(Name,S,N,V) int Name(int Cn, int Cp, int v, int CurLim) {return(CheckRules(Cn,Cp,V,N,S,CurLim));}
+#define Checkers(N) \
+  Checker(Check1_##N,1,N,((N == 1) ? 1 : v)) \
+  Checker(Check2_##N,2,N,((N == 1) ? 1 : v)) \
+  Checker(Check3_##N,3,N,((N == 1) ? 1 : v)) \
+  Checker(Check4_##N,4,N,((N == 1) ? 1 : v)) \
+  Checker(Check5_##N,5,N,((N == 1) ? 1 : v)) \
+  Checker(CheckBass_##N,1,N,1) \
+  Checker(CheckInner_##N,1,N,v)
+
+Checkers(1)
+Checkers(2)
+Checkers(3)
+Checkers(4)
+Checkers(5)
+
+CheckFunction LastVoiceChecks[6][MostVoices] = {
+  {0, 0, 0, 0, 0, 0},
+  {0, Check1_1, Check1_2, Check1_3, Check1_4, Check1_5},
+  {0, Check2_1, Check2_2, Check2_3, Check2_4, Check2_5},
+  {0, Check3_1, Check3_2, Check3_3, Check3_4, Check3_5},
+  {0, Check4_1, Check4_2, Check4_3, Check4_4, Check4_5},
+  {0, Check5_1, Check5_2, Check5_3, Check5_4, Check5_5}};
+CheckFunction BassChecks[MostVoices] = {0, CheckBass_1, CheckBass_2, CheckBass_3, CheckBass_4, CheckBass_5};
+CheckFunction InnerChecks[MostVoices] = {0, CheckInner_1, CheckInner_2, CheckInner_3, CheckInner_4, CheckInner_5};
+
+Local CheckFunction VoiceCheck[MostVoices];	/* the checker Look uses for each voice */
+Local int CheckParts,CheckSpecies;		/* the solve's, set by SpecializeCheck */
+
+/* Snapshots (see fux snap and fux micro).  While Snapping, SpecializeCheck
+ * puts SnapCheck in front of each voice's checker, and every SnapEvery'th
+ * check it saves the state the check saw, with what Check, OtherVoiceCheck
+ * and SpecialSpeciesCheck made of it, until SnapCount reaches SnapLimit.
+ * Only one thread should snap at a time.
+ */
+
+typedef struct {
+  int Mode, BasePitch, TotalTime, NumParts, Species;	/* Species is the last voice's */
+  int Cn, Cp, v, CurLim;
+  int Penalty, OtherPenalty, SpecialPenalty;
+  short TotalNotes[MostVoices];
+  short Ctrpt[MostNotes][MostVoices], Onset[MostNotes][MostVoices], Dur[MostNotes][MostVoices];
+} Snapshot;
+
+int Snapping = 0;
+int SnapEvery = 997;
+int SnapCount,SnapLimit;
+Snapshot *Snaps;
+Local CheckFunction SnappedCheck[MostVoices];
+Local long SnapCalls;
+
+/* SpecialSpeciesCheck with the arguments CheckRules would give it */
+int SpecialCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+{
+  int Other0,Other1,Other2,Interval,LastCp,LastMelInt,LastIntClass;
+  Other2=0; LastMelInt=0; LastIntClass=0;
+  if (v == 1)
+    {
+      Other0=Cantus(Cn,v);
+      Other1=Cantus(Cn-1,v);
+      if (Cn>2) {Other2=Cantus(Cn-2,v);}
+    }
+  else
+    {
+      Other0=Bass(Cn,v);
+      Other1=Bass(Cn-1,v);
+      if (Cn>2) {Other2=Bass(Cn-2,v);}
+    }
+  LastCp=Us(Cn-1,v);
+  Interval=(Cp-Other0);
+  if (Cn>2) LastMelInt=(LastCp-Us(Cn-2,v));
+  if (Cn>1) LastIntClass=((ABS(LastCp-Other1)) % 12);
+  return(SpecialSpeciesCheck(Cn,Cp,v,Other0,Other1,Other2,NumParts,Species,Cp-LastCp,Interval,(ABS(Interval)) % 12,LastIntClass,Cp % 12,LastMelInt,CurLim));
+}
+
+int OtherCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+{
+  return((v > 1) ? OtherVoiceCheck(Cn,Cp,v,NumParts,Species,CurLim) : 0);
+}
+
+void SaveSnapshot(Snapshot *s, int Cn, int Cp, int v, int CurLim, int Penalty)
+{
+  int i,u,Species;
+  s->Mode=Mode; s->BasePitch=BasePitch; s->TotalTime=TotalTime; s->NumParts=CheckParts; s->Species=CheckSpecies;
+  s->Cn=Cn; s->Cp=Cp; s->v=v; s->CurLim=CurLim;
+  for (u=0;u<=CheckParts;u++)
+    {
+      s->TotalNotes[u]=TotalNotes[u];
+      for (i=0;i<MostNotes;i++)
+	{
+	  s->Ctrpt[i][u]=Ctrpt[i][u];
+	  s->Onset[i][u]=Onset[i][u];
+	  s->Dur[i][u]=Dur[i][u];
+	}
+    }
+  Species=((v == CheckParts) ? CheckSpecies : 1);
+  s->Penalty=Penalty;
+  s->OtherPenalty=OtherCheck(Cn,Cp,v,CheckParts,Species,CurLim);
+  s->SpecialPenalty=SpecialCheck(Cn,Cp,v,CheckParts,Species,CurLim);
+}
+
+int SnapCheck(int Cn, int Cp, int v, int CurLim)
+{
+  int Val;
+  Val=SnappedCheck[v](Cn,Cp,v,CurLim);
+  if ((((++SnapCalls) % SnapEvery) == 0) && (SnapCount < SnapLimit)) SaveSnapshot(Snaps+(SnapCount++),Cn,Cp,v,CurLim,Val);
+  return(Val);
+}
+
+/* The reference engine (see fux diff) is the search as it stands with the
+ * checks done by a frozen copy of the rules as they were before the clause
+ * table, the Sounded masks, the Melody and Chord tables and the specialized
+ * checkers: RefCheck and the helpers below, which charge the penalties
+ * directly.  A change meant to change what the rules charge (the streaming
+ * carry, EndNotes, the crossing count) goes into both; one meant to make the
+ * search faster must leave these alone, so that they catch it.  DiffCheck,
+ * in front of each voice's checker while Differing, compares every penalty
+ * with RefCheck's.
+ */
+
+inline int RefTotalRange(int Cn, int Cp, int v)
+{
+  int Minp,Maxp,i,pit;
+  Minp=Cp;
+  Maxp=Cp;
+  if (CarriedLow[v]) {Minp=MIN(Minp,CarriedLow[v]-BasePitch); Maxp=MAX(Maxp,CarriedHigh[v]-BasePitch);}
+  for (i=1;i<Cn;i++)
+    {
+      pit=Us(i,v);
+      Minp=MIN(Minp,pit);
+      Maxp=MAX(Maxp,pit);
+    }
+  return(Maxp-Minp);
+}
+
+inline int RefVIndex(int Time, int VNum)
+{
+  int i;
+  for (i=1;i<TotalNotes[VNum];i++)
+    if ((Onset[i][VNum] <= Time) && ((Onset[i][VNum]+Dur[i][VNum])>Time)) return(i);
+  return(i);
+}
+        
+inline int RefOther(int Cn, int v, int v1) {return(Ctrpt[RefVIndex(Onset[Cn][v],v1)][v1]);}
+
+inline int RefBass(int Cn, int v)
+{
+  int j,LowestPitch;
+  LowestPitch=Cantus(Cn,v);
+  for (j=1;j<v;j++) LowestPitch=MIN(LowestPitch,RefOther(Cn,v,j));
+  return(LowestPitch);
+}
+
+inline int RefPitchRepeats(int Cn, int Cp, int v)
+{
+  int i,k;
+  i=(((Cp+BasePitch) >= 0) && ((Cp+BasePitch) < MostNotes)) ? CarriedPitches[v][Cp+BasePitch] : 0;
+  for (k=1;k<Cn;k++) {if (Us(k,v) == Cp) i++;}
+  return(i);
+}
+
+int RefTooMuchOfInterval(int Cn, int Cp, int v)
+{
+  int Ints[17];
+  int i,k,MinL;
+  for (i=0;i<17;i++) Ints[i]=CarriedIntervals[v][i];
+  for (i=2;i<Cn;i++)
+    {
+      k=(Size(Ctrpt[i][v]-Ctrpt[i-1][v])+8);
+      Ints[k]++;
+    }
+  k=(Size(Cp-Ctrpt[Cn-1][v])+8);
+  MinL=0;
+  for (i=1;i<17;i++) {if ((i != k) && (Ints[i]>Ints[MinL])) MinL=i;}
+  return(Ints[k]>(Ints[MinL]+6));
+}
+
+int RefADissonance(int Interval, int Cn, int Cp, int v, int Species)
+{
+  int MelInt;
+  if ((Species == 1) || (Dur[Cn][v] == WholeNote))
+    return(Dissonance[Interval]);
+  else
+    {
+      if (Species == 2)
+	{
+	  if (DownBeat(Cn,v) || (!(AStep(Cp-Us(Cn-1,v)))))
+	    return(Dissonance[Interval]);
+	  else return(0);
+	}
+      else
+	{
+	  if (Species == 3)
+	    {
+	      if ((Beat8(Onset[Cn][v]) == 0) || (FirstNote(Cn,v) || LastNote(Cn,v)))
+		return(Dissonance[Interval]);
+	      MelInt=(Cp-Us(Cn-1,v));
+	      if (!(AStep(MelInt))) return(Dissonance[Interval]);
+	      /* 0 cannot be dissonant (downbeat)
+	       * 1 can be if passing either way, but must be approached by step.
+	       * 2 can be if passing 2 to 4 (both latter cons)
+	       * 3 can be if passing but must be approached and left by step
+	       */
+	      return(0);
+	    }
+	  else
+	    {
+	      if (Species == 4)
+		{
+		  if (UpBeat(Cn,v) || (FirstNote(Cn,v) || LastNote(Cn,v)))
+		    return(Dissonance[Interval]);
+		  MelInt=(Cp-Us(Cn-1,v));
+		  if (MelInt != 0) return(Dissonance[Interval]);
+		  return(0);	/* i.e. unison to downbeat is ok, but needs check later */
+		}
+	      else
+		{
+		  if (Species == 5)
+		    {
+		      if (Beat8(Onset[Cn][v]) == 0)
+			{
+			  if (Cp == Us(Cn-1,v)) return(0);
+			  else return(Dissonance[Interval]);
+			}
+		      else
+			{
+			  if (!(AStep(Cp-Us(Cn-1,v)))) return(Dissonance[Interval]);
+			  return(0);
+			}
+		    }
+		}
+	    }
+	}
+    }
+  return(0);
+}
+
+int RefDoubled(int Pitch, int Cn, int v)
+{
+  int VNum;
+  for (VNum=0;VNum<v;VNum++)
+    {
+      if ((((RefOther(Cn,v,VNum) % 12)+12) % 12) == Pitch) return(1);
+    }
+  return(0);
+}
+
+int RefSpecialSpeciesCheck(int Cn, int Cp, int v, int Other0, int Other1, int Other2, int NumParts,
+			int Species, int MelInt, int Interval, int ActInt, int LastIntClass, int Pitch, int LastMelInt, int CurLim)
+{
+  int Val,Above,i,LastDisInt;
+  if (Species == 1) return(0);	/* no special rules for 1st species */
+  Val=0;
+  if (Species == 2)
+    {
+      if ((NextToLastNote(Cn,v)) && ((Pitch == 11) || (Pitch == 10)))
+	{
+	  if ((Mode != Phrygian) || (Interval >= 0))
+	    {
+	      if (LastIntClass !=  Fifth) Val += BadCadencePenalty;
+	    }
+	  else
+	    {
+	      if (LastIntClass != MinorSixth) Val += BadCadencePenalty;
+	    }
+	}
+    }
+  else
+    {
+      if (Species == 4)
+	{
+	  if ((DownBeat(Cn,v)) && (MelInt != Unison)) Val += NotaLigaturePenalty;
+	  if ((UpBeat(Cn,v)) && (Dissonance[LastIntClass]))
+	    {
+	      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += UnresolvedLigaturePenalty;
+	      if ((ActInt == Unison) && ((Interval<0) || (((ABS(Us(Cn-2,v)-Other2)) % 12) == Unison))) Val += NoTimeForaLigaturePenalty;
+	      if ((ActInt == Fifth) || (ActInt == Tritone)) Val += NoTimeForaLigaturePenalty;
+	    }
+	}
+      else
+	{
+	  Above=(Interval >= 0);
+	  
+	  /* added check to stop optimizer from changing 4th beat passing tones into repeated notes+skip */
+	  if (((Beat8(Onset[Cn][v]) == 6) || (Beat8(Onset[Cn][v]) == 7)) && (Cp == Us(Cn-1,v))) Val += UnisonOnBeat4Penalty;
+	  
+	  /* skip to down beat seems not so great */
+	  if (Beat8(Onset[Cn][v]) == 0)
+	    {
+	      if (ASkip(MelInt)) Val += SkipToDownBeatPenalty;
+	      if ((Cn>2) && ((ActInt == Unison) || (ActInt == Fifth)))
+		{
+		  if (Species == 5)
+		    {
+		      i=(Cn-1);
+		      while ((i>0) && ((Beat8(Onset[i][v])) != 0)) i--;
+		    }
+		  else i=(Cn-4);
+		  if (((ABS(Us(i,v)-RefBass(i,v))) % 12) == ActInt) Val += DownBeatUnisonPenalty;
+		}
+	    }
+	  
+	  /* check for cambiata not resolved correctly (on 4th beat) */
+	  if ((Beat8(Onset[Cn][v]) == 6) && 
+	      ((AThird(ABS(LastMelInt))) &&
+	       ((Dissonance[(ABS(Us(Cn-2,v)-Other2)) % 12]) &&
+		((MelInt<0) || ((ABS(MelInt) != MajorSecond) && (ABS(MelInt) != MinorSecond))))))
+	    Val += NotaCambiataPenalty;
+	  if (Val >= CurLim) return(Val);
+	  
+	  if ((Species == 3) && ((Cn>1) && (Dissonance[LastIntClass])))
+	    {
+	      switch (Beat8(Onset[Cn][v]))
+		{
+		case 0: case 6:
+		  if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || ((MelInt*LastMelInt)<0))) Val += DissonancePenalty;
+		  break;
+		case 2:
+		  Val += DissonancePenalty;
+		  break;
+		case 4:
+		  if ((!(AStep(LastMelInt))) || ((ABS(MelInt)>MajorThird) || ((MelInt == 0) || ((LastMelInt*MelInt)<0))))
+		    Val += DissonancePenalty;
+		  else
+		    {
+		      if (!(AStep(MelInt)))
+			{
+			  if (Above)
+			    {
+			      if (!(ASeventh(LastIntClass))) Val += DissonancePenalty;
+			    }
+			  else
+			    {
+			      if (LastIntClass != Fourth) Val += DissonancePenalty;
+			    }
+			}
+		    }
+		  break;
+		}
+	    }
+	  
+	  if (Species == 5)
+	    {
+	      if ((Cn>1) && ((Beat8(Onset[Cn][v]) == 0) && ((Cp != Us(Cn-1,v)) && (Dur[Cn][v] <= Dur[Cn-1][v]))))
+		Val += LesserLigaturePenalty;
+	      if ((Cn>3) && ((Dur[Cn][v] == HalfNote) && ((Beat8(Onset[Cn][v]) == 4) &&
+		  ((Dur[Cn-1][v] == QuarterNote) && (Dur[Cn-2][v] == QuarterNote)))))
+		Val += HalfUntiedPenalty;
+	      if ((Dur[Cn][v] == EighthNote) && ((DownBeat(Cn,v)) && (Dissonance[ActInt])))
+		Val += DissonancePenalty;
+	      if (Val >= CurLim) return(Val);
+	      if (Cn>1) {LastDisInt = ((ABS(Us(Cn-1,v)-Other1)) % 12);}
+	      if ((Cn>1) && (Dissonance[LastDisInt]))
+		{
+		  switch (Beat8(Onset[Cn-1][v]))
+		    {
+		    case 6: case 4:
+		      if (!((LastDisInt == Fourth) && ((MelInt == Unison) &&
+			    (((Other0-Other1) == Unison) && (Beat8(Onset[Cn][v]) == 0)))))
+			{
+			  if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || 
+			      (((MelInt*LastMelInt)<0) || ((Dur[Cn-1][v] == EighthNote) ||
+			       ((Dur[Cn-1][v] == QuarterNote) && (Dur[Cn-2][v] == HalfNote))))))
+			    Val += DissonancePenalty;
+			}
+		      break;
+		    case 1: case 3: case 5: case 7:
+		      if ((!(AStep(MelInt))) || ((!(AStep(LastMelInt))) || ((MelInt*LastMelInt)<0)))
+			Val += DissonancePenalty;
+		      break;
+		    case 0:
+		      if ((Dur[Cn-2][v] == EighthNote) || (Dur[Cn-2][v]<Dur[Cn-1][v])) Val += NoTimeForaLigaturePenalty;
+		      if ((MelInt != (-MinorSecond)) && (MelInt != (-MajorSecond))) Val += UnresolvedLigaturePenalty;
+		      if ((ActInt == Fourth) || (ActInt == Tritone)) Val += NoTimeForaLigaturePenalty;
+		      if ((ActInt == Fifth) && (Interval<0)) Val += NoTimeForaLigaturePenalty;
+		      if ((ActInt == 0) && (((ABS(Us(Cn-2,v)-Other2)) % 12) == 0)) Val += NoTimeForaLigaturePenalty;
+		      if (LastMelInt != Unison) Val += DissonancePenalty;
+		      break;
+		    case 2:
+		      if ((!(AStep(LastMelInt))) || ((ABS(MelInt)>MajorThird) ||
+			  ((MelInt == 0) || ((Dur[Cn-1][v] == EighthNote) || ((LastMelInt*MelInt)<0)))))
+			Val += DissonancePenalty;
+		      else
+			{
+			  if (!(AStep(MelInt)))
+			    {
+			      if (Above)
+				{   
+				  if (!(ASeventh(LastIntClass))) Val += DissonancePenalty;
+				}
+			      else
+				{
+				  if (LastIntClass != Fourth) Val += DissonancePenalty;
+				}
+			    }
+			}
+		      break;
+		    }
+		}
+	      if ((Cn>1) && ((Dur[Cn-1][v] == EighthNote) && (!(AStep(MelInt))))) Val += EighthJumpPenalty;
+	      if ((Cn>1) && ((Dur[Cn-1][v] == HalfNote) && ((Beat8(Onset[Cn][v]) == 4) && (MelInt == Unison))))
+		Val += UnisonUpbeatPenalty;
+	    }
+	}
+    }
+  return(Val);
+}
+
+#define INTERVALS_WITH_BASS_SIZE 8
+Local int IntervalsWithBass[INTERVALS_WITH_BASS_SIZE];
+    /* 0 = octave, 2 = step, 3 = third, 4 = fourth, 5 = fifth, 6 = sixth, 7 = seventh */
+
+void RefAddInterval(int n)
+{
+  int ActInt;
+  switch (((n % 12)+12) % 12)
+    {
+    case 0: ActInt = 0; break;
+    case 1: case 2: ActInt = 2; break;
+    case 3: case 4: ActInt = 3; break;
+    case 5: case 6: ActInt = 4; break;
+    case 7: ActInt = 5; break;
+    case 8: case 9: ActInt = 6; break;
+    case 10: case 11: ActInt = 7; break;
+    }
+  IntervalsWithBass[ActInt]++;
+}
+
+int RefOtherVoiceCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+{
+  int Val,k,CurBass,Other0,Other1,Int0,Int1,ActPitch,IntBass,LastCp,AllSkip,i,ourLastInt;
+  if (v == 1) return(0);	/* two part or bass voice, so nothing to check */
+  for (i=0;i<INTERVALS_WITH_BASS_SIZE;i++) IntervalsWithBass[i]=0;
+  Val=0;
+  CurBass=RefBass(Cn,v);
+  if (Cp <= CurBass) Val += CrossBelowBassPenalty;
+  IntBass=((Cp-CurBass) % 12);
+  if ((IntBass == MajorThird) && (!(InMode(CurBass,Mode)))) Val += AugmentedIntervalPenalty;
+  ActPitch=(Cp % 12);
+  
+  if ((Val >= CurLim) || ((v == NumParts) && (Dissonance[IntBass]))) return(Val);
+  /* logic here is that only the last part can be non-1st species
+     and may therefore have various dissonances that don't want to be
+     calculated as chord tones
+     */
+  LastCp=Us(Cn-1,v);
+  AllSkip=ASkip(Cp-LastCp);
+  RefAddInterval(IntBass);
+  for (k=0;k<v;k++)
+    {
+      Other0=RefOther(Cn,v,k);
+      Other1=RefOther(Cn-1,v,k);
+      if (!(ASkip(Other0-Other1))) AllSkip=0;
+      RefAddInterval(Other0-CurBass);	/* add up tones in chord */
+      /* avoid unison with other voice */
+      if ((!(LastNote(Cn,v))) && (Other0 == Cp)) Val += UnisonPenalty;
+
+      /* keep upper voices closer together than lower */
+      if ((Other0 != CurBass) && ((ABS(Cp-Other0)) >= (Octave+Fifth))) Val += UpperVoicesTooFarApartPenalty;
+
+      /* check for direct motion to perfect consonance between these two voices */
+      Int0=((ABS(Other0-Cp)) % 12);
+      Int1=((ABS(Other1-LastCp)) % 12);
+      if (Int1 == Int0)
+	{
+          if (Int0 == Unison) Val += ParallelUnisonPenalty;
+	  else if (Int0 == Fifth) Val += ParallelFifthPenalty;
+	}
+      if ((Cn>2) && ((Int0 == Unison) && (((ABS(Us(Cn-2,v)-RefOther(Cn-2,v,k))) % 12) == Unison)))
+        Val += ParallelUnisonPenalty;
+
+      if (Val >= CurLim) return(Val);
+
+      /* penalize tritones between voices */
+      if (Int0 == Tritone) Val += VerticalTritonePenalty;
+
+      if (Species == 5)
+	{
+          if ((Dissonance[Int1]) && (Int1 != Fourth))
+	    {
+              ourLastInt=((LastCp-RefBass(Cn-1,v)) % 12);
+              if (ourLastInt != Unison)	/* if unison, 6-6 somewhere else? */
+		{
+                  if (ourLastInt == Fifth)
+		    {
+                      if ((ASkip(Cp-LastCp)) || (Cp >= LastCp)) Val += UnresolvedSixFivePenalty;
+		    }
+		  else
+		    {
+		      if ((ASkip(Other0-Other1)) || (Other0 >= Other1)) Val += UnresolvedSixFivePenalty;
+		    }
+		}
+	    }
+          if ((Dissonance[Int0]) && ((Int0 != Fourth) && (IntBass != Unison)))
+	    {
+              if ((IntBass == Fifth && ((Cp-LastCp) != Unison)) ||
+		  ((IntBass != Fifth) && ((Other0-Other1) != Unison)))
+		Val += UnpreparedSixFivePenalty;
+	    }
+	}
+
+      /* penalize direct motion to perfect consonance except at the cadence */
+      if ((!(LastNote(Cn,v))) && (DirectMotionToPerfectConsonance(LastCp,Cp,Other1,Other0)))
+	Val += InnerVoicesInDirectToPerfectPenalty;
+
+      /* if we have an unraised leading tone it is possible that some other
+       * voice has the raised form thereof (since the voices can move at very
+       * different paces, one voice's next to last note may be long before
+       * another's) 
+       */
+      if ((ActPitch == 10) &&	 	        /* if 11 we've aready checked */
+	  ((Other0 % 12) == 11))		/* They have the raised form */
+        Val += DoubledLeadingTonePenalty;
+
+      /* similarly for motion to a tritone */
+      if ((MotionType(LastCp,Cp,Other1,Other0) == DirectMotion) && (Int0 == Tritone))
+        Val += InnerVoicesInDirectToTritonePenalty;
+
+      /* look for a common diminished fourth (when a raised leading tone is in 
+       * the bass, a "major third" above it is actually a diminished fourth.
+       * Similarly, an augmented fifth can be formed in other cases 
+       */
+      if ((ActPitch == 3) && ((Other0 % 12) == 11)) Val += AugmentedIntervalPenalty;
+
+      /* try to encourage voices not to move in parallel too much */
+      if (MotionType(LastCp,Cp,Other1,Other0) != ContraryMotion) Val += NotContraryToOthersPenalty;
+    }
+
+  /* check for doubled third */
+  if (IntervalsWithBass[3]>1) Val += ThirdDoubledPenalty;
+
+  /* check for doubled sixth */
+  if ((IntervalsWithBass[3] == 0) && (IntervalsWithBass[6]>1)) Val += DoubledSixthPenalty;
+  
+  /* check for too many voices at octaves */
+  if (IntervalsWithBass[0]>2) Val += TripledBassPenalty;
+
+  /* check for doubled fifth */
+  if (IntervalsWithBass[5]>1) Val += DoubledFifthPenalty;
+
+  /* check that chord contains at least one third or sixth */
+  if ((v == NumParts) && ((!(LastNote(Cn,v))) && ((IntervalsWithBass[3] == 0) && (IntervalsWithBass[6] == 0))))
+    Val += NotTriadPenalty;
+  
+  /* discourage all voices from skipping at once */
+  if ((v == NumParts) && AllSkip) Val += AllVoicesSkipPenalty;
+  
+  /* except in 5th species, disallow 6-5 chords altogether */
+  if ((IntervalsWithBass[5]>0) && ((IntervalsWithBass[6]>0) && (Species != 5))) Val += SixFiveChordPenalty;
+  return(Val);
+}
+
+int RefCheck(int Cn, int Cp, int v, int NumParts, int Species, int CurLim)
+{
+  int Val,k,Interval,IntClass,Pitch,LastIntClass,MelInt,LastMelInt,Other0,Other1,Other2;
+  int Cross,SameDir,WeHaveARealLeadingTone,LastPitch,totalJump,LastCp,LastCp2,LastCp3,LastCp4;
+  Other2=0; LastMelInt=0; SameDir=1; LastIntClass=0;	/* until there are 3 notes */
+  if (v == 1)
+    {
+      Other0=Cantus(Cn,v);
+      Other1=Cantus(Cn-1,v);
+      if (Cn>2) {Other2=Cantus(Cn-2,v);}
+    }
+  else
+    {
+      Other0=RefBass(Cn,v);
+      Other1=RefBass(Cn-1,v);
+      if (Cn>2) {Other2=RefBass(Cn-2,v);}
+    }
+  Val=0;
+  LastCp=Us(Cn-1,v);
+  LastCp2=0; LastCp3=0; LastCp4=0;
+  Interval=(Cp-Other0);
+  IntClass=(ABS(Interval)) % 12;
+  MelInt=(Cp-LastCp);
+  Pitch=(Cp % 12);
+
+  /* melody must stay in range */
+  if (OutOfRange(Cp+BasePitch)) Val += OutOfRangePenalty;
+
+  /* extremes of range are also bad (to be avoided) */
+  if (ExtremeRange(Cp+BasePitch)) Val += ExtremeRangePenalty;
+
+  /* two part with ctrpt below cantus -- keep it below */
+  if ((NumParts == 1) && (((NotesBefore[v]) ? CarriedBelow[v] : (Us(1,v) < Cantus(1,v))) && (Interval > Unison))) Val += CrossAboveCantusPenalty;
+
+  /* Chromatically altered notes are accepted only at the cadence.  Other alterations (such as ficta) will be handled later) */
+  if (!(NextToLastNote(Cn,v)))
+    {
+      if (Species != 2)
+	{
+	  if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
+	}
+      else
+	{
+	  if ((Cn != EndNotes[v]-2) || ((Mode != Aeolian) || ((Cp <= Other0) || (IntClass != Fifth))))
+	    {
+              if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
+	    }
+	}
+    }
+  else
+    {
+      WeHaveARealLeadingTone = ((Pitch == 11) || ((Pitch == 10) && (Mode == Phrygian)));
+      if (WeHaveARealLeadingTone)
+	{
+	  if (RefDoubled(Pitch,Cn,v)) Val += DoubledLeadingTonePenalty;
+	}
+      else
+	{
+	  if (Pitch == 10) Val += BadCadencePenalty;
+	  else
+	    {
+	      if (!(InMode(Pitch,Mode))) Val += OutOfModePenalty;
+	      else
+		{
+		  if (v == NumParts)
+		    {
+		      if ((!(RefDoubled(11,Cn,v))) && (!(RefDoubled(10,Cn,v)))) Val += NoLeadingTonePenalty;
+		    }
+		}
+	    }
+	}
+    }
+  if (Val >= CurLim) return(Val);
+  if (Cn>2)
+    {
+      LastCp2=Us(Cn-2,v);
+      if (Cn>3)
+	{
+	  LastCp3=Us(Cn-3,v);
+	  if (Cn>4) LastCp4=Us(Cn-4,v);
+	}
+      LastMelInt=(LastCp-LastCp2);
+      SameDir=((MelInt*LastMelInt) >= 0);
+    }
+  if (Cn>1) {LastIntClass=((ABS(LastCp-Other1)) % 12);}
+  if (RefADissonance(IntClass,Cn,Cp,v,Species)) Val += DissonancePenalty;
+  if (Val >= CurLim) return(Val);
+  Val += RefSpecialSpeciesCheck(Cn,Cp,v,Other0,Other1,Other2,NumParts,Species,MelInt,Interval,IntClass,LastIntClass,Pitch,LastMelInt,CurLim);
+  if (v>1) Val += RefOtherVoiceCheck(Cn,Cp,v,NumParts,Species,CurLim);
+  if (FirstNote(Cn,v)) return(Val);
+  /* no further rules apply to first note */
+  if (Val >= CurLim) return(Val);
+
+  /* direct motion to perfect consonances considered harmful */
+  if ((!(LastNote(Cn,v))) || (NumParts == 1))
+    {
+      if (DirectMotionToPerfectConsonance(LastCp,Cp,Other1,Other0))
+	{
+	  if (IntClass == Unison) Val += DirectToOctavePenalty;
+	  else Val += DirectToFifthPenalty;
+	}
+    }
+
+  /* check for more blatant examples of the same error */
   if ((IntClass == Fifth) && (LastIntClass == Fifth)) Val += ParallelFifthPenalty;
   if ((IntClass == Unison) && (LastIntClass == Unison)) Val += ParallelUnisonPenalty;
   if (Val >= CurLim) return(Val);
 
-  if ((Cn>1) && ((Species == 1) && ((NumParts == 1) && ((IntClass == LastIntClass) && (MelInt == Unison)))))
-    Val += NoMotionAgainstOctavePenalty;
+  if ((Cn>1) && ((Species == 1) && ((NumParts == 1) && ((IntClass == LastIntClass) && (MelInt == Unison)))))
+    Val += NoMotionAgainstOctavePenalty;
+
+  /* certain melodic intervals are disallowed */
+  if (BadMelody(MelInt)) Val += BadMelodyPenalty;
+  if (Val >= CurLim) return(Val);
+
+  /* must end on unison or octave in two parts, fifth and major third allowed in 3 and 4 part writing */
+  if ((LastNote(Cn,v)) && (IntClass != Unison))
+    {
+      if ((NumParts == 1) || (Interval<0)) Val += EndOnPerfectPenalty;
+      else
+	{
+          if ((IntClass != Fifth) && (IntClass != MajorThird)) Val += EndOnPerfectPenalty;
+	}
+    }
+
+  /* penalize direct motion any kind (contrary motion is better) */
+  if (MotionType(LastCp,Cp,Other1,Other0) == DirectMotion)
+    {
+      Val += DirectMotionPenalty;
+      if (IntClass == Tritone) Val += DirectToFifthPenalty;
+    }
+
+  /* penalize compound intervals (close position is favored) */
+  if ((ABS(Interval))>Octave) Val += CompoundPenalty;
+
+  /* penalize consecutive skips in the same direction */
+  if ((Cn>2) && (ConsecutiveSkipsInSameDirection(LastCp2,LastCp,Cp)))
+    {
+      Val += TwoSkipsPenalty;
+      totalJump=ABS(Cp-LastCp2);
+
+      /* do not let these skips traverse more than an octave, nor a seventh */
+      if ((totalJump > MajorSixth) && (totalJump < Octave)) Val += TwoSkipsNotInTriadPenalty;
+    }
+
+  /* penalize a skip to an octave */
+  if ((IntClass == Unison) && ((ASkip(MelInt)) || (ASkip(Other0-Other1)))) Val += SkipTo8vePenalty;
+
+  /* do not skip from a unison (not a very important rule) */
+  if ((Other1 == LastCp) && (ASkip(MelInt))) Val += SkipFromUnisonPenalty;
+
+  /* penalize skips followed or preceded by motion in same direction */
+  if ((Cn>2) && ((ASkip(MelInt)) && SameDir))
+    {
+      /* especially penalize fifths, sixths, and octaves of this sort */
+      if ((ABS(MelInt)) < Fifth) Val += SkipPrecededBySameDirectionPenalty;
+      else
+	{
+          if (((ABS(MelInt)) == Fifth) || ((ABS(MelInt)) == Octave)) 
+	    Val += FifthPrecededBySameDirectionPenalty;
+	  else Val += SixthPrecededBySameDirectionPenalty;
+	}
+    }
+  if ((Cn>2) && ((ASkip(LastMelInt)) && SameDir))
+    {
+      if ((ABS(LastMelInt)) < Fifth) Val += SkipFollowedBySameDirectionPenalty;
+      else
+	{
+          if (((ABS(LastMelInt)) == Fifth) || ((ABS(LastMelInt)) == Octave))
+            Val += FifthFollowedBySameDirectionPenalty;
+          else Val += SixthFollowedBySameDirectionPenalty;
+	}
+    }
+
+  /* too many skips in a row -- favor a mix of steps and skips */
+    if ((Cn>4) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (ASkip(LastCp2-LastCp3))))) Val += MelodicBoredomPenalty;
+
+  /* avoid tritones melodically */
+  if ((Cn>4) && (((ABS(Cp-LastCp2)) == Tritone) || (((ABS(Cp-LastCp3)) == Tritone) || ((ABS(Cp-LastCp4)) == Tritone))))
+    Val += MelodicTritonePenalty;
+
+  /* do not allow movement from a tenth to an octave by contrary motion */
+  if ((Species != 5) && (NumParts == 1))
+    {
+      if (ATenth(Other1-LastCp) && (AnOctave(Interval))) Val += TenthToOctavePenalty;
+    }
+
+  /* more range checks -- did we go over an octave recently */
+  if ((Cn>2) && ((ABS(Cp-LastCp2)) > Octave)) Val += OverOctavePenalty;
+
+  /* same for a twelfth */
+  if ((((Cn+NotesBefore[v])>30) || (Species != 5)) && (RefTotalRange(Cn,Cp,v) > (Octave+Fifth))) Val += OverTwelfthPenalty;
+  if (Val >= CurLim) return(Val);
+
+  /* slightly penalize repeated notes */
+  if ((Cn>3) && ((Cp == LastCp2) && (LastCp == LastCp3))) Val += TwoRepeatedNotesPenalty;
+  if ((Cn>5) && ((Cp == LastCp3) && ((LastCp == LastCp4) && (LastCp2 == Us(Cn-5,v))))) Val += ThreeRepeatedNotesPenalty;
+  if ((Cn>6) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) && (LastCp2 == Us(Cn-6,v))))) Val += (ThreeRepeatedNotesPenalty-1);
+  if ((Cn>7) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) &&
+       ((LastCp2 == Us(Cn-6,v)) && (LastCp3 == Us(Cn-7,v)))))) Val += FourRepeatedNotesPenalty;
+  if ((Cn>8) && ((Cp == Us(Cn-5,v)) && ((LastCp == Us(Cn-6,v)) &&
+      ((LastCp2 == Us(Cn-7,v)) && (LastCp3 == Us(Cn-8,v)))))) Val += FourRepeatedNotesPenalty;
+  if (LastNote(Cn,v))
+    {
+      LastPitch=(LastCp % 12);
+      if (((LastPitch == 11) || ((LastPitch == 10) && (Mode == Phrygian))) && (Pitch != 0)) Val += UnresolvedLeadingTonePenalty;
+    }
+  if (Val >= CurLim) return(Val);
+
+  /* an imperfect consonance is better than a perfect consonance */
+  if (PerfectConsonance[IntClass]) Val += PerfectConsonancePenalty;
+
+  /* no unisons allowed within counterpoint unless more than 2 parts */
+  if ((NumParts == 1) && (Interval == Unison)) Val += UnisonPenalty;
+  if (Val >= CurLim) return(Val);
+
+  /* seek variety by avoiding pitch repetitions */
+  Val += (RefPitchRepeats(Cn,Cp,v)>>1);
+
+  /* penalize octave leaps a little */
+  if (AnOctave(MelInt)) Val += OctaveLeapPenalty;
+
+  /* similarly for minor sixth leaps */
+  if (MelInt == MinorSixth) Val += SixthLeapPenalty;
+
+  /* penalize upper neighbor notes slightly (also lower neighbors) */
+  if ((Cn>2) && ((MelInt<0) && ((AStep(MelInt)) && (Cp == LastCp2)))) Val += UpperNeighborPenalty;
+  if ((Cn>2) && ((MelInt>0) && ((AStep(MelInt)) && (Cp == LastCp2)))) Val += LowerNeighborPenalty;
+
+  /* do not allow normal leading tone to precede raised leading tone */
+  /* also check here for augmented fifths and diminished fourths */
+  if ((!(InMode(Pitch,Mode))) && ((MelInt == MinorSecond) || ((MelInt == MinorSixth) || (MelInt == (-MajorThird))))) Val += OutOfModePenalty;   
+
+  /* slightly frown upon leap back in the opposite direction */
+  if ((Cn>2) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (!(SameDir)))))
+    {
+      Val += (MAX(0,((ABS(MelInt)+ABS(LastMelInt))-8)));
+      if ((Cn>3) && (ASkip(LastCp2-LastCp3))) Val += ThreeSkipsPenalty;
+    }
+
+  /* try to approach cadential passages by step */
+  if ((NumParts == 1) && ((Cn >= (EndNotes[v]-4)) && ((ABS(MelInt)) > 4))) Val += LeapAtCadencePenalty;
+
+  /* check for entangled voices */
+  Cross=CarriedCross[v];
+  if (NumParts == 1)
+    {
+      for (k=4;k<Cn;k++)
+	{
+          if ((Us(k,v)-Cantus(k,v))*(Us(k-1,v)-Cantus(k-1,v)) < 0) Cross++;
+	}
+      if ((Cn>=4) && (((Cp-Other0)*(LastCp-Other1)) < 0)) Cross++;
+    }
+  if (Cross > 0) Val += (MAX(0,((Cross-2)*3)));
+  
+  /* don't repeat note on upbeat */
+  if (UpBeat(Cn,v) && (MelInt == Unison)) Val += RepetitionOnUpbeatPenalty;
+ 
+  /* avoid tritones near Lydian cadence */
+  if ((Mode == Lydian) && ((Cn>(EndNotes[v]-4)) && (Pitch == 6))) Val += LydianCadentialTritonePenalty;
+
+  /* various miscellaneous checks.  More elaborate dissonance resolution and cadential formula checks will be given under "Species definition" */
+  if ((Species != 1) && (DownBeat(Cn,v)))
+    {
+      if (Species<4)
+	{
+	  if ((MelInt == Unison) && (!(LastNote(Cn,v)))) Val += UnisonDownbeatPenalty;
+	  /* check for dissonance that doesn't fill a third as a passing tone */
+	  if ((Dissonance[LastIntClass]) && ((!(AStep(MelInt))) || (!(SameDir)))) Val += DissonanceNotFillingThirdPenalty;
+	}
+
+      /* check for Direct 8ve or 5 where the intervening interval is less than a fourth */
+      if ((DirectMotionToPerfectConsonance(LastCp2,Cp,Other2,Other0)) && ((ABS(LastMelInt)) < Fourth))
+	Val += DirectPerfectOnDownbeatPenalty;
+    }
+
+  /* check for tritone with cantus or bass */
+  if (IntClass == Tritone) Val += VerticalTritonePenalty;
+
+  /* check for melodic interval variety */
+  if (((Cn+NotesBefore[v])>10) && (RefTooMuchOfInterval(Cn,Cp,v))) Val += MelodicBoredomPenalty;
+
+  return(Val);
+}
+
+
+Local int ReferenceEngine;
+Local int Differing;
+Local CheckFunction DiffedCheck[MostVoices];
+Local long DiffChecks,DiffCandidates;
+Local int DiffAt[5];			/* the first difference: Cn, Cp, v, penalty, reference's penalty */
+
+void UseReference(int On)
+{
+  ReferenceEngine=On;
+}
+
+int ReferenceCheck(int Cn, int Cp, int v, int CurLim)
+{
+  return(RefCheck(Cn,Cp,v,CheckParts,((v == CheckParts) ? CheckSpecies : 1),CurLim));
+}
+
+/* two penalties at or over CurLim both reject the candidate, however far over they got */
+inline int Differs(int Val, int Ref, int CurLim) {return((Val != Ref) && ((Val < CurLim) || (Ref < CurLim)));}
+
+int DiffCheck(int Cn, int Cp, int v, int CurLim)
+{
+  int Val,Ref;
+  Val=DiffedCheck[v](Cn,Cp,v,CurLim);
+  Ref=ReferenceCheck(Cn,Cp,v,CurLim);
+  DiffChecks++;
+  if (Differs(Val,Ref,CurLim))
+    {
+      if (DiffCandidates++ == 0) {DiffAt[0]=Cn; DiffAt[1]=Cp+BasePitch; DiffAt[2]=v; DiffAt[3]=Val; DiffAt[4]=Ref;}
+    }
+  return(Val);
+}
+
+void SpecializeCheck(int NumParts, int Species)
+{
+  int v;
+  CheckParts=NumParts;
+  CheckSpecies=Species;
+  SoundAll(NumParts);
+  TablesReady();
+  UseTables=1;
+  for (v=1;v<=NumParts;v++)
+    {
+      if (ReferenceEngine) VoiceCheck[v]=ReferenceCheck;
+      else if (v == NumParts) VoiceCheck[v]=LastVoiceChecks[Species][NumParts];
+      else if (v == 1) VoiceCheck[v]=BassChecks[NumParts];
+      else VoiceCheck[v]=InnerChecks[NumParts];
+    }
+  if ((Differing) && (!(ReferenceEngine)))
+    for (v=1;v<=NumParts;v++)
+      {
+	DiffedCheck[v]=VoiceCheck[v];
+	VoiceCheck[v]=DiffCheck;
+      }
+  if (Snapping)
+    {
+      for (v=1;v<=NumParts;v++)
+	{
+	  SnappedCheck[v]=VoiceCheck[v];
+	  VoiceCheck[v]=SnapCheck;
+	}
+    }
+}
+
+/* set up the state a snapshot saw (SpecializeCheck too, so Snapping should be off) */
+void LoadSnapshot(Snapshot *s)
+{
+  int i,u;
+  Mode=s->Mode; BasePitch=s->BasePitch; TotalTime=s->TotalTime;
+  for (u=0;u<=s->NumParts;u++)
+    {
+      TotalNotes[u]=s->TotalNotes[u];
+      for (i=0;i<MostNotes;i++)
+	{
+	  Ctrpt[i][u]=s->Ctrpt[i][u];
+	  Onset[i][u]=s->Onset[i][u];
+	  Dur[i][u]=s->Dur[i][u];
+	}
+    }
+  ClearCarried();
+  SpecializeCheck(s->NumParts,s->Species);
+}
+
+
+Local int BestFit[MostNotes][MostVoices];
+Local int BestFit1[MostNotes][MostVoices]; /* next-to-best fits (for testing) */
+Local int BestFit2[MostNotes][MostVoices];
+Local int Fits[3];
+Local int BestFitPenalty,MaxPenalty,Branches,AllDone;
+Local long SearchNodes;		/* onsets expanded, ever (fux bench takes differences) */
+Local float PenaltyRatio;
+
+#define NumFields 16
+#define Field (MostVoices+1)
+#define EndF (Field*NumFields)
+
+/* Re-tuning the clause order: StartTuning, solve a few typical jobs on
+ * this thread, then FinishTuning puts first the clauses that most often end
+ * a check for what they cost.  The order is the thread's own, like the rest
+ * of the search state, so it is tuned and used only on the thread that asks
+ * for it (other threads, such as RunJobs' workers, keep theirs).  Call these
+ * between solves.
+ */
+
+void SetClauseOrder(int *Order)
+{
+  int i;
+  FirstClauses=0;
+  for (i=0;i<NumberOfClauses;i++)
+    {
+      ClauseOrder[i]=Order[i];
+      if (ClauseTable[Order[i]].First) FirstClauseOrder[FirstClauses++]=Order[i];
+    }
+}
+
+/* back to the table's order */
+void ResetClauseOrder()
+{
+  int i,Order[NumberOfClauses];
+  for (i=0;i<NumberOfClauses;i++) Order[i]=i;
+  SetClauseOrder(Order);
+}
+
+void StartTuning()
+{
+  int i;
+  for (i=0;i<=NumberOfClauses;i++) ClauseExits[i]=0;
+  TuningClauses=1;
+}
+
+void FinishTuning()
+{
+  int i,j,c,Order[NumberOfClauses];
+  long Runs;
+  double Rate[NumberOfClauses];
+  Runs=0;
+  for (i=NumberOfClauses;i>=0;i--)
+    {
+      Runs += ClauseExits[i];	/* the checks that got to position i */
+      if (i < NumberOfClauses)
+	{
+	  c=ClauseOrder[i];
+	  Rate[c]=((Runs > 0) ? (((double)ClauseExits[i])/(Runs*ClauseTable[c].Cost)) : 0.0);
+	}
+    }
+  for (i=0;i<NumberOfClauses;i++)
+    {
+      c=ClauseOrder[i];
+      for (j=i;(j > 0) && (Rate[Order[j-1]] < Rate[c]);j--) Order[j]=Order[j-1];
+      Order[j]=c;
+    }
+  TuningClauses=0;
+  SetClauseOrder(Order);
+}
+
+int SaveIndx(int indx, int *Sp)
+{
+  int i;
+  /* if INDX is less than current NUMFIELD-th worst,
+   * find its position in SP, insert space for its
+   * data, and return a pointer to the block.  The
+   * blocks are stored "backwards" for (SAIL's) ARRBLT 
+   */
+  i=EndF;
+  while ((i>=0) && (Sp[i]<=indx)) {i-=Field;}
+  if (i>0)	/* 0 is the end of the list.  If i>0 then we insert INDX */
+    {
+      ARRBLT(Sp,(int *)(Sp+Field),i);
+      Sp[i]=indx;
+      /* SP[i]=penalty for block starting at I.  SP[i-1]=index into
+       * melodic interval array for voice 1, SP[i-2] for voice 2 and
+       * so on.  The searcher starts at SP[EndF] and works backwards
+       * through the stored continuations as it searches for a satisfactory
+       * overall solution 
+       */
+    }
+  return(i);
+}
+
+int Indx[17] = {0,1,-1,2,-2,3,-3,0,4,-4,5,7,-5,8,12,-7,-12};
+
+/* Move ordering (if HistoryOrdering is set): Look tries first the offset
+ * that gave the best local penalty the last time it was at this note
+ * (the killer), then the rest by how often they ended up in a saved
+ * solution from the same beat and previous melodic interval.  Trying good
+ * candidates first lowers Look's limit sooner, and among equal penalties
+ * puts the promising one first in Pens.
+ */
+
+int HistoryOrdering = 0;
+Local int UseHistory;				/* HistoryOrdering, or the portfolio strategy's choice */
+Local int History[MostVoices][2][25][17];	/* voice, downbeat, last melodic interval+12, Indx index */
+Local int Killer[MostNotes][MostVoices];
+Local int HistoryWeight;
+
+void ClearHistory()
+{
+  int i,v;
+  for (v=0;v<MostVoices;v++)
+    {
+      for (i=0;i<(2*25*17);i++) (&History[v][0][0][0])[i]=0;
+      for (i=0;i<MostNotes;i++) Killer[i][v]=0;
+    }
+  HistoryWeight=0;
+}
+
+inline int HistoryInterval(int n, int v)
+{
+  if (n<3) return(12);
+  return(MIN(24,MAX(0,(Us(n-1,v)-Us(n-2,v))+12)));
+}
+
+void OrderCandidates(int n, int v, int *Order)
+{
+  int i,j,k,Start,*h;
+  h=History[v][DownBeat(n,v)][HistoryInterval(n,v)];
+  k=0;
+  if (Killer[n][v]) Order[k++]=Killer[n][v];
+  Start=k;
+  for (i=1;i<=16;i++)
+    {
+      if (i == Killer[n][v]) continue;
+      for (j=k;(j>Start) && (h[Order[j-1]]<h[i]);j--) Order[j]=Order[j-1];
+      Order[j]=i;
+      k++;
+    }
+}
+
+/* credit each offset in the solution about to be saved (later, better, solutions count for more) */
+void CreditHistory(int v1)
+{
+  int i,v,j,MelInt;
+  HistoryWeight++;
+  for (v=1;v<=v1;v++)
+    for (i=2;i<=TotalNotes[v];i++)
+      {
+	MelInt=(Us(i,v)-Us(i-1,v));
+	for (j=1;j<=16;j++)
+	  {
+	    if (Indx[j] == MelInt)
+	      {
+		History[v][DownBeat(i,v)][HistoryInterval(i,v)][j] += HistoryWeight;
+		break;
+	      }
+	  }
+      }
+}
+
+/* Portfolio solve (see PortfolioSpecies).  While a thread runs one of its
+ * strategies, Plan is that Strategy and Running the Portfolio it is part of
+ * (if any, see ImproveSolution): each onset BestFitFirst enters takes up the
+ * best penalty any strategy has found (Bound), and gives up (AllDone) once
+ * told to Stop or out of time.
+ */
+
+typedef struct {
+  float Ratio;		/* PenaltyRatio (0 = AnySpecies' own, 1 = never prune short of the best fit, so exhaustive) */
+  int BrLim;		/* branches between tightenings (0 = AnySpecies' own) */
+  int History;		/* UseHistory */
+  int Seed;		/* if not 0, Look tries the candidates in an order shuffled by it */
+  int Discrepancy;	/* if not 0, DiscrepancySearch with a budget of Discrepancy-1 */
+} Strategy;
+
+#define MostStrategies 16
+
+typedef struct {
+  int Mode, Species, Voices, Length, Count, Next;
+  long Rand;		/* the caller's randx: strategy n starts from Rand+n, so they try different fifth species rhythms */
+  int Cantus[MostNotes], StartPitches[MostVoices];
+  int (*Starts)[MostVoices];	/* if set, job n starts from Starts[n] under Plans[0] (see ChooseStarts) */
+  Strategy *Plans;
+  double End;
+  volatile int Bound, Stop;
+  int Winner, Proved;	/* the winner's fit follows */
+  int Penalty, BasePitch, TotalTime, Fits[3], TotalNotes[MostVoices];
+  int Best[3][MostNotes][MostVoices], Dur[MostNotes][MostVoices], Onset[MostNotes][MostVoices];
+#ifdef THREADS
+  pthread_mutex_t Lock;
+#endif
+} Portfolio;
+
+Local Strategy *Plan;
+Local Portfolio *Running;
+Local double PlanDeadline;
+Local int PlanPolls;
+Local int PortfolioProved;
+Local int Shuffle[17],Shuffling;
+
+double Now()
+{
+  struct timeval t;
+  gettimeofday(&t,NULL);
+  return(t.tv_sec+(t.tv_usec*.000001));
+}
+
+void ShuffleCandidates(int Seed)
+{
+  int i,j,t;
+  unsigned int r;
+  r=Seed;
+  for (i=0;i<=16;i++) Shuffle[i]=i;
+  for (i=16;i>1;i--)
+    {
+      r=((r*1103515245)+12345);
+      j=(1+((r >> 16) % i));
+      t=Shuffle[i]; Shuffle[i]=Shuffle[j]; Shuffle[j]=t;
+    }
+}
+
+int Polled()
+{
+  int b;
+  b=((Running) ? Running->Bound : infinity);
+  if ((((++PlanPolls) & 255) == 0) && ((b < infinity) || (Plan->Ratio >= 1.0)) && (Now() > PlanDeadline)) AllDone=1;
+  if ((Running) && (Running->Stop)) AllDone=1;
+  if (b < infinity) MaxPenalty=MIN(MaxPenalty,b*PenaltyRatio);
+  return(AllDone);
+}
+
+/* lower Bound to our BestFitPenalty if that's better */
+void Publish()
+{
+  int b;
+  while (BestFitPenalty < (b=Running->Bound))
+    if (__sync_bool_compare_and_swap(&(Running->Bound),b,BestFitPenalty)) break;
+}
+
+/* Pruning budgets.  Left to itself, BestFitFirst tightens MaxPenalty by
+ * AnySpecies' fixed PenaltyRatio every BrLim branches, however the search is
+ * going.  Given a budget (BudgetSeconds or BudgetNodes, onsets expanded, for
+ * this thread, else the command line's PruneSeconds and PruneNodes), the
+ * search starts out exhaustive (PenaltyRatio 1), and every BrLim branches
+ * Tighten sets MaxPenalty to the best fit times a ratio that depends on how
+ * much of the budget is used and how much of the search so far has gone by
+ * since the last better fit: a search still improving is left alone, a
+ * stalled one is squeezed harder and harder as its budget runs out, and once
+ * the budget is spent the search stops.  A search that has found nothing by
+ * then goes on tightening as AnySpecies would until it does (or gives up).
+ * Budgeted or not, BestFitFirst notes the least penalty of anything it cuts
+ * off short of the best fit, so afterwards SearchFloor is a lower bound on
+ * what the search would have found with PenaltyRatio 1, and
+ * BestFitPenalty-SearchFloor is the gap it gave up.
+ */
+
+#define Squeeze 0.25	/* half way through its budget, a stalled search cuts off anything not this much under the best fit */
+
+double PruneSeconds = 0;	/* -budget */
+long PruneNodes = 0;		/* -nodes */
+Local double BudgetSeconds;	/* if set, this thread's budgets (see fux.solve) */
+Local long BudgetNodes;
+Local double SearchSeconds,SearchStart,SearchTime,FixedRatio;
+Local long SearchBudget,SearchFrom,LastGain;
+Local int Budgeting,CutFloor,SearchFloor;
+
+inline void NoteCut(int Penalty)
+{
+  if (Penalty < CutFloor) CutFloor=Penalty;
+}
+
+void StartBudget()
+{
+  SearchSeconds=((BudgetSeconds > 0) ? BudgetSeconds : PruneSeconds);
+  SearchBudget=((BudgetNodes > 0) ? BudgetNodes : PruneNodes);
+  Budgeting=(((SearchSeconds > 0) || (SearchBudget > 0)) && (!(Plan)));
+  FixedRatio=PenaltyRatio;
+  if (Budgeting) PenaltyRatio=1.0;
+  SearchStart=Now();
+  SearchFrom=SearchNodes;
+  LastGain=SearchNodes;
+  CutFloor=infinity;
+}
+
+void EndBudget()
+{
+  SearchTime=(Now()-SearchStart);
+  SearchFloor=MIN(CutFloor,BestFitPenalty);
+  Budgeting=0;
+}
+
+/* set PenaltyRatio for the next BrLim branches, or return 1 once the budget is spent */
+int Tighten()
+{
+  double Used,Time;
+  long Nodes;
+  Nodes=(SearchNodes-SearchFrom);
+  Used=((SearchBudget > 0) ? ((double)Nodes/SearchBudget) : 0.0);
+  if (SearchSeconds > 0)
+    {
+      Time=((Now()-SearchStart)/SearchSeconds);
+      if (Time > Used) Used=Time;
+    }
+  if (BestFitPenalty >= infinity)	/* nothing to tighten towards: look freely, then as AnySpecies would */
+    {
+      if (Used >= 1.0) PenaltyRatio=FixedRatio;
+      return(0);
+    }
+  if (Used >= 1.0) return(1);
+  PenaltyRatio=(1.0-((Squeeze*Used/(1.0-Used))*((double)(SearchNodes-LastGain)/((Nodes > 0) ? Nodes : 1))));
+  if (PenaltyRatio < 0) PenaltyRatio=0;
+  return(0);
+}
+
+/* SEARCH TRACES
+ *
+ * With -trace file, BestFitFirst on the thread that called StartTrace
+ * appends a TraceEvent to file, which is mapped into memory and doubled as it
+ * fills: one as it enters an onset (with the penalty so far and MaxPenalty),
+ * one once Look has ranked the continuations at the next onset (how many, and
+ * the best), one as it leaves (how many it tried), one each time BrLim
+ * tightens MaxPenalty, and one for each new best fit.  Micros is the time
+ * since StartTrace.  fux trace file summarises a trace (see SummariseTrace).
+ */
+
+enum {TraceEnter=1, TraceLook, TraceLeave, TracePrune, TraceBest};
+
+typedef struct {unsigned char Kind,Pad; short CurTime; int Penalty,Arg; unsigned int Micros;} TraceEvent;
+typedef struct {char Magic[8]; unsigned int Version,EventSize;} TraceHeader;
+
+Local TraceHeader *TraceFile;		/* NULL = not tracing */
+Local TraceEvent *TraceEvents;
+Local long TraceCount,TraceRoom;
+Local int TraceFd;
+Local double TraceStart;
+
+/* (re)map the trace with room for Room events */
+int MapTrace(long Room)
+{
+  TraceHeader *h;
+  if (TraceFile) munmap((void *)TraceFile,sizeof(TraceHeader)+(TraceRoom*sizeof(TraceEvent)));
+  TraceFile=NULL;
+  if (ftruncate(TraceFd,sizeof(TraceHeader)+(Room*sizeof(TraceEvent))) < 0) return(0);
+  h=(TraceHeader *)mmap(NULL,sizeof(TraceHeader)+(Room*sizeof(TraceEvent)),PROT_READ | PROT_WRITE,MAP_SHARED,TraceFd,0);
+  if (h == MAP_FAILED) return(0);
+  TraceFile=h;
+  TraceEvents=(TraceEvent *)(h+1);
+  TraceRoom=Room;
+  return(1);
+}
+
+int StartTrace(char *Name)
+{
+  TraceFd=open(Name,O_RDWR | O_CREAT | O_TRUNC,0644);
+  if (TraceFd < 0) return(0);
+  TraceFile=NULL;
+  TraceCount=0;
+  if (!(MapTrace(65536))) {close(TraceFd); return(0);}
+  memcpy(TraceFile->Magic,"FUXTRACE",8);
+  TraceFile->Version=1;
+  TraceFile->EventSize=sizeof(TraceEvent);
+  TraceStart=Now();
+  return(1);
+}
+
+void EndTrace()
+{
+  if (!(TraceFile)) return;
+  munmap((void *)TraceFile,sizeof(TraceHeader)+(TraceRoom*sizeof(TraceEvent)));
+  TraceFile=NULL;
+  if (ftruncate(TraceFd,sizeof(TraceHeader)+(TraceCount*sizeof(TraceEvent))) < 0) perror("trace");
+  close(TraceFd);
+}
+
+/* callers check TraceFile first, so an untraced search pays one test per event */
+void Traced(int Kind, int CurTime, int Penalty, int Arg)
+{
+  TraceEvent *e;
+  if ((TraceCount == TraceRoom) && (!(MapTrace(2*TraceRoom))))
+    {
+      fprintf(stderr,"trace: out of room after %ld events\n",TraceCount);
+      close(TraceFd);
+      return;
+    }
+  e=(TraceEvents+(TraceCount++));
+  e->Kind=Kind; e->Pad=0;
+  e->CurTime=CurTime;
+  e->Penalty=Penalty;
+  e->Arg=Arg;
+  e->Micros=(unsigned int)((Now()-TraceStart)*1000000);
+}
+
+/* a search run as a coroutine, handing back each new best fit (see OpenSolutions) */
+typedef struct {
+  ucontext_t Caller,Search;
+  char *Stack;
+  int Mode,Species,Voices,Length;
+  int Cantus[MostNotes],StartPitches[MostVoices];
+  int Below;			/* the caller wants fits under this */
+  int Penalty;			/* the last fit handed back, or infinity */
+  int Started,Finished,Abandoned;
+  volatile int Orphaned;	/* closed on another thread: the owner unwinds it */
+#ifdef THREADS
+  pthread_t Owner;		/* the search's state is this thread's */
+#endif
+} SolutionIterator;
+
+Local SolutionIterator *Pulling;	/* the iterator whose search is running, if any */
+Local SolutionIterator *Suspended;	/* the iterator whose search is stopped in SaveResults, if any */
+
+/* called by SaveResults: hand the new best fit to NextSolution and wait to be resumed */
+void YieldSolution()
+{
+  SolutionIterator *it;
+  it=Pulling;
+  swapcontext(&(it->Search),&(it->Caller));
+  if (it->Abandoned) AllDone=1;
+  else if (it->Below < BestFitPenalty)
+    {
+      BestFitPenalty=it->Below;
+      MaxPenalty=MIN(MaxPenalty,it->Below*PenaltyRatio);
+    }
+}
+
+int ShowFits = 1;	/* print each improvement as it is found */
+
+void ShowBestFit(int v1)
+{
+#ifndef CM
+  int i,v;
+  if ((!ShowFits) || (Plan)) return;
+  printf("\n [%d] ",BestFitPenalty);
+  for (v=1;v<=v1;v++)
+    {
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+	  printf("%d ",BestFit[i][v]);
+	}
+      printf("\n");
+    }
+#endif
+}
+
+void SaveResults(int CurrentPenalty, int Penalty, int v1, int Species)
+{
+  int i,LastPitch,v,Cn,k,Pitch,done;
+  if (UseHistory) CreditHistory(v1);
+  for (v=1;v<=v1;v++)
+    {
+      /* check all voices for raised leading tone */
+      Cn=TotalNotes[v];
+      if (Cn != EndNotes[v]) continue;	/* no cadence in this stream window */
+      LastPitch=(Us(Cn-1,v) % 12);	/* must be raised if any are */
+      if (!(InMode(LastPitch,Mode)))    /* it is a raised leading tone */
+	{
+	  k=2;
+	  while (1)                     /* exit via break */
+	    {
+	      /* look backwards through voice's notes */
+	      if (k >= (Cn-1)) break;	                /* ran off start!! */
+              Pitch=(Us(Cn-k,v) % 12);	                /* current pitch */
+              if (((Pitch<8) && (Pitch != 0)) ||	/* not 6-7-1 scale degree anymore */
+                  (ASkip(Us(Cn-k+1,v)-Us(Cn-k,v))))     /* skip breaks drive to cadence */
+		break;
+              Pitch=ABS(Us(Cn-k,v)-Us(Cn-k-1,v));       /* interval with raised leading tone */
+              if ((Pitch == Fourth) || ((Pitch == Fifth) || ((Pitch == Unison) || (Pitch == Octave)))) break;
+	      /* don't create illegal melody */
+	      done = 0;
+	      i=0;
+	      while (i<=v1)             /* do others have unraised form? */
+		{
+		  if ((i != v) && (((Other(Cn-k,v,i)) % 12) == 11)) 
+		    {
+		      done = 1;
+		      break;
+		    }
+		  i++;
+		}
+	      if (done) break;
+	      if (((Us(Cn-1,v)-Us(Cn-k,v)) == MinorThird) || ((Us(Cn-1,v)-Us(Cn-k,v)) == MinorSecond))
+                SetUs(Cn-k,Us(Cn-k,v)+1,v);            /* raise it and maybe 6th degree too */
+	      k++;
+	    }
+	}
+    }
+  BestFitPenalty=CurrentPenalty+Penalty;
+  MaxPenalty=MIN(BestFitPenalty*PenaltyRatio,MaxPenalty);
+  LastGain=SearchNodes;
+/*  AllDone=1; */
+  if (Running) Publish();
+  if (TraceFile) Traced(TraceBest,TotalTime,BestFitPenalty,MaxPenalty);
+  Fits[2]=Fits[1]; Fits[1]=Fits[0]; Fits[0]=BestFitPenalty;
+  for (v=1;v<=v1;v++)
+    {
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+ 	  BestFit2[i][v]=BestFit1[i][v];       
+ 	  BestFit1[i][v]=BestFit[i][v];        
+	  BestFit[i][v]=Ctrpt[i][v]+BasePitch; 
+	}
+    }
+  ShowBestFit(v1);
+  if (Pulling) YieldSolution();
+}
+
+Local int Pinned[MostNotes][MostVoices];	/* absolute pitch the note must take, 0 = free */
+
+/* a pinned note has only one candidate, recorded as index 0 in Is and Pens */
+inline int Candidate(int n, int v, int ix)
+{
+  if (ix == 0) return(Pinned[n][v]-BasePitch);
+  return(Indx[ix]+Ctrpt[n-1][v]);
+}
+
+int Look(int CurPen, int CurVoice, int NumParts, int Species, int Lim, int *Pens, int *Is, int *CurNotes)
+{
+  int penalty,Pit,i,x,NewLim,First,Last,k,LocalBest;
+  int Order[17];
+  NewLim=Lim;
+  LocalBest=infinity;
+  if (Pinned[CurNotes[CurVoice]][CurVoice]) {First=0; Last=0;} else {First=1; Last=16;}
+  if (UseHistory && Last) OrderCandidates(CurNotes[CurVoice],CurVoice,Order+1);
+  for (k=First;k<=Last;k++)
+    {
+      if (UseHistory && k) Is[CurVoice]=Order[k]; else if (Shuffling && k) Is[CurVoice]=Shuffle[k]; else Is[CurVoice]=k;
+      Pit=Candidate(CurNotes[CurVoice],CurVoice,Is[CurVoice]);
+      if (CurNotes[CurVoice] <= SettledNotes[CurVoice]) penalty=CurPen;
+      else penalty=CurPen+VoiceCheck[CurVoice](CurNotes[CurVoice],Pit,CurVoice,NewLim-CurPen);
+      SetUs(CurNotes[CurVoice],Pit,CurVoice);
+      if (penalty<NewLim)
+	{
+	  if (penalty<LocalBest)
+	    {
+	      LocalBest=penalty;
+	      Killer[CurNotes[CurVoice]][CurVoice]=Is[CurVoice];
+	    }
+          if (CurVoice<NumParts)
+	    {
+	      i=(CurVoice+1);
+	      while (i<=NumParts)
+		{
+		  if (CurNotes[i] != 0) break;
+		  i++;
+		}
+              if (i <= NumParts)	/* there is another voice needing a note */
+                {
+		  NewLim=Look(penalty,i,NumParts,Species,NewLim,Pens,Is,CurNotes);
+		}
+	    }
+	  else
+	    {
+	      x=SaveIndx(penalty,Pens);
+	      if (x>0)
+		{
+		  for (i=1;i<=NumParts;i++) Pens[x-i]=Is[i];
+		}
+	      else NewLim=MIN(NewLim,penalty);
+	    }
+	}
+    }
+  return(NewLim);
+}
+
+/* find the next onset after CurTime and rank (in Pens) the best continuations there; returns that onset */
+int LookAhead(int CurTime, int NumParts, int Species, int Lim, int *Pens, int *Is, int *CurNotes)
+{
+  int i,j,NextTime,OurTime;
+  for (i=0;i<=(Field*NumFields);i++) Pens[i]=infinity;
+  for (i=0;i<=NumParts;i++) Is[i]=0;
+  for (i=0;i<=MostVoices;i++) CurNotes[i]=0;
+  NextTime=infinity;
+  for (i=0;i<=NumParts;i++)
+    {
+      OurTime=Onset[VIndex(CurTime,i)+1][i];
+      if (OurTime != 0) NextTime=MIN(NextTime,OurTime);
+    }
+  for (i=1;i<=NumParts;i++)
+    {
+      j=VIndex(NextTime,i);
+      if (Onset[j][i] == NextTime) CurNotes[i]=j;
+    }
+  i=1;
+  while (i<=NumParts)
+    {
+      if (CurNotes[i] != 0) break;
+      i++;
+    }
+  Look(0,i,NumParts,Species,Lim,Pens,Is,CurNotes);
+  return(NextTime);
+}
+
+void BestFitFirst(int CurTime, int CurrentPenalty, int NumParts, int Species, int BrLim)
+{
+  int i,CurMin,ChoiceIndex,NextTime,Tried;
+  int *Pens,*Is,*CurNotes;
+  if (AllDone) return;
+  if (CurrentPenalty>MaxPenalty) {NoteCut(CurrentPenalty); return;}
+  if ((Plan) && (Polled())) return;
+  Branches++;
+  if ((Budgeting) && (Branches == BrLim) && (Tighten())) {AllDone=1; NoteCut(CurrentPenalty); return;}
+  SearchNodes++;
+  if (TraceFile) Traced(TraceEnter,CurTime,CurrentPenalty,MaxPenalty);
+
+  Pens=(int *)calloc(1+(Field*NumFields),sizeof(int));
+  Is=(int *)calloc(1+NumParts,sizeof(int));
+  CurNotes=(int *)calloc(1+MostVoices,sizeof(int));
+
+  ChoiceIndex=EndF;
+  AllDone=0;
+
+  if (Branches == BrLim)
+    {
+      if ((Budgeting) && (BestFitPenalty < infinity)) MaxPenalty=(BestFitPenalty*PenaltyRatio);	/* Tighten's ratio is to the best, not a step */
+      else MaxPenalty = MaxPenalty*PenaltyRatio;
+      Branches=0;
+      if (TraceFile) Traced(TracePrune,CurTime,MaxPenalty,BrLim);
+    }
+
+  NextTime=LookAhead(CurTime,NumParts,Species,BestFitPenalty-CurrentPenalty,Pens,Is,CurNotes);
+  if (TraceFile)
+    {
+      for (i=EndF;(i > 0) && (Pens[i] < infinity);i-=Field);
+      Traced(TraceLook,NextTime,Pens[EndF],(EndF-i)/Field);
+    }
+
+  Tried=0;
+  CurMin=Pens[ChoiceIndex];
+  if (CurMin < infinity)
+    {
+      AllDone=0;
+      while (!(AllDone))
+	{
+	  if (CurTime<TotalTime)
+	    {
+	      if ((CurMin+CurrentPenalty) >= MaxPenalty) {NoteCut(CurMin+CurrentPenalty); break;}
+	    }
+	  else
+	    {
+	      if ((CurMin+CurrentPenalty) >= BestFitPenalty) break;
+	    }
+	  
+	  for (i=1;i<=NumParts;i++)
+	    {
+	      if (CurNotes[i] != 0) SetUs(CurNotes[i],Candidate(CurNotes[i],i,Pens[ChoiceIndex-i]),i);
+	    }
+	  Tried++;
+	  if (NextTime<TotalTime)
+	    BestFitFirst(NextTime,CurrentPenalty+CurMin,NumParts,Species,BrLim);
+	  else
+	    SaveResults(CurrentPenalty,CurMin,NumParts,Species);
+	  
+	  ChoiceIndex=ChoiceIndex-Field;
+	  if (ChoiceIndex <= 0) break;
+	  CurMin=Pens[ChoiceIndex];
+	  if (CurMin == infinity) break;
+	  if (CurTime == 0) MaxPenalty=(BestFitPenalty*PenaltyRatio);
+	}
+      if ((AllDone) && (CurMin < infinity)) NoteCut(CurMin+CurrentPenalty);	/* stopped with this and the rest untried */
+    }
+  if (TraceFile) Traced(TraceLeave,CurTime,CurrentPenalty,Tried);
+
+  free(CurNotes);
+  free(Is);
+  free(Pens);
+}
 
-  /* certain melodic intervals are disallowed */
-  if (BadMelody(MelInt)) Val += BadMelodyPenalty;
-  if (Val >= CurLim) return(Val);
+/* Limited discrepancy search (if LimitedDiscrepancy is set, AnySpecies uses
+ * it instead of BestFitFirst).  Taking a continuation Look ranked lower at
+ * an onset is a discrepancy, unless the better ones all dead-ended within
+ * DeadEndNodes onsets (otherwise a greedy path that runs into a wall a note
+ * or two later would use up the budget).  Pass k follows only the paths
+ * with at most k discrepancies, from k = 0 (straight down the best
+ * continuations) up to DiscrepancyBudget, each bounded by the best fit so
+ * far.  It stops sooner if a pass never had to pass up a continuation, since
+ * that pass saw everything, and if no pass finds anything we fall back on
+ * BestFitFirst.  DiscrepancyNodes counts the onsets expanded.
+ */
 
-  /* must end on unison or octave in two parts, fifth and major third allowed in 3 and 4 part writing */
-  if ((LastNote(Cn,v)) && (IntClass != Unison))
+int LimitedDiscrepancy = 0;
+int DiscrepancyBudget = 1;
+int DeadEndNodes = 16;
+Local long DiscrepancyNodes;
+Local int DiscrepancyCut;
+
+/* returns 1 unless every path from here dead-ended */
+int DiscrepancyDive(int CurTime, int CurrentPenalty, int NumParts, int Species, int Left)
+{
+  int i,CurMin,ChoiceIndex,NextTime,Viable,Spend;
+  long Before;
+  int *Pens,*Is,*CurNotes;
+  if ((Plan) && (Polled())) return(1);
+  DiscrepancyNodes++;
+  SearchNodes++;
+  Pens=(int *)calloc(1+(Field*NumFields),sizeof(int));
+  Is=(int *)calloc(1+NumParts,sizeof(int));
+  CurNotes=(int *)calloc(1+MostVoices,sizeof(int));
+  NextTime=LookAhead(CurTime,NumParts,Species,BestFitPenalty-CurrentPenalty,Pens,Is,CurNotes);
+  Viable=0;
+  Spend=0;
+  for (ChoiceIndex=EndF;ChoiceIndex>0;ChoiceIndex-=Field)
     {
-      if ((NumParts == 1) || (Interval<0)) Val += EndOnPerfectPenalty;
+      CurMin=Pens[ChoiceIndex];
+      if (CurMin == infinity) break;
+      if ((CurMin+CurrentPenalty) >= BestFitPenalty)
+	{
+	  Viable=1;
+	  break;
+	}
+      if (AllDone) break;
+      if ((Spend) && (Left == 0))
+	{
+	  DiscrepancyCut=1;
+	  break;
+	}
+      for (i=1;i<=NumParts;i++)
+	{
+	  if (CurNotes[i] != 0) SetUs(CurNotes[i],Candidate(CurNotes[i],i,Pens[ChoiceIndex-i]),i);
+	}
+      if (NextTime<TotalTime)
+	{
+	  Before=DiscrepancyNodes;
+	  if (DiscrepancyDive(NextTime,CurrentPenalty+CurMin,NumParts,Species,Left-Spend)) Viable=1;
+	  else if ((DiscrepancyNodes-Before) > DeadEndNodes) Spend=1;
+	  if (Viable) Spend=1;
+	}
       else
 	{
-          if ((IntClass != Fifth) && (IntClass != MajorThird)) Val += EndOnPerfectPenalty;
+	  SaveResults(CurrentPenalty,CurMin,NumParts,Species);
+	  Viable=1;
+	  Spend=1;
 	}
     }
+  free(CurNotes);
+  free(Is);
+  free(Pens);
+  return(Viable);
+}
 
-  /* penalize direct motion any kind (contrary motion is better) */
-  if (MotionType(LastCp,Cp,Other1,Other0) == DirectMotion)
+void DiscrepancySearch(int NumParts, int Species, int BrLim, int Budget)
+{
+  int k;
+  DiscrepancyNodes=0;
+  for (k=0;k<=Budget;k++)
     {
-      Val += DirectMotionPenalty;
-      if (IntClass == Tritone) Val += DirectToFifthPenalty;
+      DiscrepancyCut=0;
+      DiscrepancyDive(0,0,NumParts,Species,k);
+      if (!(DiscrepancyCut)) break;
     }
+  if ((BestFitPenalty == infinity) && (!(AllDone))) BestFitFirst(0,0,NumParts,Species,BrLim);
+}
 
-  /* penalize compound intervals (close position is favored) */
-  if ((ABS(Interval))>Octave) Val += CompoundPenalty;
+Local int RhyPat[11][9],RhyNotes[11];
 
-  /* penalize consecutive skips in the same direction */
-  if ((Cn>2) && (ConsecutiveSkipsInSameDirection(LastCp2,LastCp,Cp)))
+void FillRhyPat()
+{
+  RhyPat[0][1]=WholeNote;
+  RhyNotes[0]=1;
+  RhyPat[1][0]=0; RhyPat[1][1]=HalfNote; RhyPat[1][2]=HalfNote;
+  RhyNotes[1]=2;
+  RhyPat[2][0]=0; RhyPat[2][1]=HalfNote; RhyPat[2][2]=QuarterNote; RhyPat[2][3]=QuarterNote; 
+  RhyNotes[2]=3;
+  RhyPat[3][0]=0; RhyPat[3][1]=QuarterNote; RhyPat[3][2]=QuarterNote; RhyPat[3][3]=QuarterNote; RhyPat[3][4]=QuarterNote; 
+  RhyNotes[3]=4;
+  RhyPat[4][0]=0; RhyPat[4][1]=QuarterNote; RhyPat[4][2]=QuarterNote; RhyPat[4][3]=HalfNote; 
+  RhyNotes[4]=3;
+  RhyPat[5][0]=0; RhyPat[5][1]=QuarterNote; RhyPat[5][2]=EighthNote; RhyPat[5][3]=EighthNote; RhyPat[5][4]=HalfNote;
+  RhyNotes[5]=4;
+  RhyPat[6][0]=0; RhyPat[6][1]=QuarterNote; RhyPat[6][2]=EighthNote; RhyPat[6][3]=EighthNote; RhyPat[6][4]=QuarterNote; RhyPat[6][5]=QuarterNote;
+  RhyNotes[6]=5;
+  RhyPat[7][0]=0; RhyPat[7][1]=HalfNote; RhyPat[7][2]=QuarterNote; RhyPat[7][3]=EighthNote; RhyPat[7][4]=EighthNote;
+  RhyNotes[7]=4;
+  RhyPat[8][0]=0; RhyPat[8][1]=QuarterNote; RhyPat[8][2]=EighthNote; RhyPat[8][3]=EighthNote; 
+  RhyPat[8][4]=QuarterNote; RhyPat[8][5]=EighthNote; RhyPat[8][6]=EighthNote; 
+  RhyNotes[8]=6;
+  RhyPat[9][0]=0; RhyPat[9][1]=QuarterNote; RhyPat[9][2]=QuarterNote; RhyPat[9][3]=QuarterNote; 
+  RhyPat[9][4]=EighthNote; RhyPat[9][5]=EighthNote; 
+  RhyNotes[9]=5;
+  RhyPat[10][1]=WholeNote;
+  RhyNotes[10]=1;
+}
+
+static Local long randx = 1;
+#define inverse_rscl .000030517578
+
+float RANDOM(float amp)
+{
+  int i = ((randx = randx*1103515245 + 12345)>>16) & 077777;
+  return(amp * (((float)i)*inverse_rscl));
+}
+
+void UsedRhy(int n) {RhyPat[n][0]=RhyPat[n][0]+1;}
+int CurRhy(int n) {return(RhyPat[n][0]);}
+void CleanRhy() {int i; for (i=1;i<10;i++) RhyPat[i][0]=0;}
+int GoodRhy()
+{
+  int i;
+  i=(int)(RANDOM(10.0));
+  if (CurRhy(i) >  CurRhy(MAX(1,(i-1)))) return(MAX(1,(i-1)));
+  if (CurRhy(i) <= CurRhy(MIN(9,(i+1)))) return(MIN(9,(i+1)));
+  return(i);
+}
+
+/* SOLUTION CACHE
+ *
+ * A file of fixed-size records, mapped into memory (read-only if the caller
+ * only wants to share it), holding the best fits of jobs already solved.
+ * Pitches are stored relative to the cantus' final, but the final itself is
+ * part of the key: the range rules see absolute pitch, so a transposed job
+ * can rank every candidate differently and needs a search of its own.  The
+ * file header carries a hash of PenaltyTable: a file written under other
+ * penalties is ignored (or cleared, if writable).  Lookup is a hash and at
+ * most CacheProbes comparisons against the mapped records; a hit is copied
+ * into BestFit and the rest of the solver's results.  Other threads and
+ * processes may be rewriting a record as we read it, so each record has a
+ * sequence number, odd while it is being written: a reader copies the record
+ * out and takes it only if the number was even and is unchanged, and a writer
+ * claims a record by making its number odd (and skips it if it can't).
+ */
+
+#define CacheProbes 8
+#define CacheVersion 3
+#define NoPitch (-128)
+
+typedef struct {
+  unsigned char Mode,Species,Voices,Length,Options,Final;	/* Final is absolute */
+  signed char Cantus[MostNotes],Starts[MostVoices];	/* relative to the final */
+} CacheKey;
+
+typedef struct {
+  unsigned int Hash;		/* 0 = empty */
+  unsigned int Seq;		/* odd while being written */
+  CacheKey Key;
+  int Fits[3];
+  unsigned char TotalNotes[MostVoices];
+  unsigned char Dur[MostVoices][MostNotes];
+  signed char Best[3][MostVoices][MostNotes];	/* BestFit, BestFit1, BestFit2 relative to the final */
+} CacheRecord;
+
+typedef struct {char Magic[8]; unsigned int Version,PenaltyHash,Slots,RecordSize; char Pad[40];} CacheHeader;
+
+CacheHeader *CacheFile = NULL;
+CacheRecord *CacheRecords;
+size_t CacheSize;
+int CacheWritable;
+#ifdef THREADS
+pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+unsigned int Fnv(unsigned int h, unsigned char *p, int n) {int i; for (i=0;i<n;i++) h=((h ^ p[i])*16777619u); return(h);}
+
+unsigned int PenaltyHash()
+{
+  return(Fnv(2166136261u,(unsigned char *)PenaltyTable,sizeof(PenaltyTable)));
+}
+
+void CloseSolutionCache()
+{
+  if (CacheFile) munmap((void *)CacheFile,CacheSize);
+  CacheFile=NULL;
+}
+
+/* map Name (creating it with Slots records if Writable and need be); returns 0 if it cannot be used */
+int OpenSolutionCache(char *Name, int Slots, int Writable)
+{
+  int fd,Fresh;
+  struct stat st;
+  CacheHeader *h;
+  CloseSolutionCache();
+  fd=open(Name,(Writable ? (O_RDWR | O_CREAT) : O_RDONLY),0644);
+  if (fd < 0) return(0);
+  if (fstat(fd,&st) < 0) {close(fd); return(0);}
+  Fresh=(st.st_size < (off_t)sizeof(CacheHeader));
+  if (!Fresh)
     {
-      Val += TwoSkipsPenalty;
-      totalJump=ABS(Cp-LastCp2);
+      h=(CacheHeader *)mmap(NULL,sizeof(CacheHeader),PROT_READ,MAP_SHARED,fd,0);
+      if (h == MAP_FAILED) {close(fd); return(0);}
+      Fresh=((memcmp(h->Magic,"FUXCACHE",8) != 0) || (h->Version != CacheVersion) || (h->PenaltyHash != PenaltyHash()) ||
+	     (h->RecordSize != sizeof(CacheRecord)) || (st.st_size < (off_t)(sizeof(CacheHeader)+(h->Slots*sizeof(CacheRecord)))));
+      if (!Fresh) Slots=h->Slots;
+      munmap((void *)h,sizeof(CacheHeader));
+    }
+  if ((Fresh) && ((!Writable) || (Slots <= 0))) {close(fd); return(0);}
+  CacheSize=(sizeof(CacheHeader)+(Slots*sizeof(CacheRecord)));
+  if ((Fresh) && (ftruncate(fd,0) < 0 || ftruncate(fd,CacheSize) < 0)) {close(fd); return(0);}
+  h=(CacheHeader *)mmap(NULL,CacheSize,(Writable ? (PROT_READ | PROT_WRITE) : PROT_READ),MAP_SHARED,fd,0);
+  close(fd);
+  if (h == MAP_FAILED) return(0);
+  if (Fresh)
+    {
+      memcpy(h->Magic,"FUXCACHE",8);
+      h->Version=CacheVersion;
+      h->PenaltyHash=PenaltyHash();
+      h->Slots=Slots;
+      h->RecordSize=sizeof(CacheRecord);
+    }
+  CacheFile=h;
+  CacheRecords=(CacheRecord *)(h+1);
+  CacheWritable=Writable;
+  return(1);
+}
 
-      /* do not let these skips traverse more than an octave, nor a seventh */
-      if ((totalJump > MajorSixth) && (totalJump < Octave)) Val += TwoSkipsNotInTriadPenalty;
+/* the key of the job AnySpecies has just set up, or 0 if it cannot be cached */
+unsigned int MakeCacheKey(CacheKey *k, int v1, int Species)
+{
+  unsigned int Hash;
+  int i,v,Final;
+  memset((void *)k,0,sizeof(CacheKey));
+  if ((CacheFile == NULL) || (TotalNotes[0] >= MostNotes)) return(0);
+  for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) if (Pinned[i][v]) return(0);
+  Final=Ctrpt[TotalNotes[0]][0];
+  k->Mode=Mode; k->Species=Species; k->Voices=v1; k->Length=TotalNotes[0]; k->Final=(Final+BasePitch);
+  k->Options=(HistoryOrdering | ((LimitedDiscrepancy) ? ((MIN(DiscrepancyBudget,62)+1) << 2) : 0));
+  for (i=1;i<=TotalNotes[0];i++) k->Cantus[i-1]=(Ctrpt[i][0]-Final);
+  for (v=1;v<=v1;v++) k->Starts[v-1]=(Ctrpt[1][v]-Final);
+  Hash=Fnv(2166136261u,(unsigned char *)k,sizeof(CacheKey));
+  return(Hash ? Hash : 1);
+}
+
+inline unsigned int RecordSeq(CacheRecord *r) {return(*((volatile unsigned int *)&(r->Seq)));}
+
+/* copy r into Copy; returns 0 if it was being written meanwhile */
+int ReadRecord(CacheRecord *r, CacheRecord *Copy)
+{
+  unsigned int Seq;
+  Seq=RecordSeq(r);
+  if (Seq & 1) return(0);
+  __sync_synchronize();
+  memcpy((void *)Copy,(void *)r,sizeof(CacheRecord));
+  __sync_synchronize();
+  return(RecordSeq(r) == Seq);
+}
+
+/* if this job is in the cache, make its record the solver's results */
+int CachedSolution(int v1, int Species)
+{
+  CacheKey k;
+  CacheRecord *r,Copy;
+  unsigned int Hash;
+  int i,j,v,f,Final;
+  Hash=MakeCacheKey(&k,v1,Species);
+  if (Hash == 0) return(0);
+  Final=(Ctrpt[TotalNotes[0]][0]+BasePitch);
+  for (j=0;j<CacheProbes;j++)
+    {
+      r=(CacheRecords+((Hash+j) % CacheFile->Slots));
+      if ((r->Hash == Hash) && (ReadRecord(r,&Copy)) &&
+	  (Copy.Hash == Hash) && (memcmp((void *)&(Copy.Key),(void *)&k,sizeof(CacheKey)) == 0)) break;
+    }
+  if (j == CacheProbes) return(0);
+  r=&Copy;
+  for (v=1;v<=v1;v++)
+    {
+      TotalNotes[v]=r->TotalNotes[v-1];
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+	  Dur[i][v]=r->Dur[v-1][i-1];
+	  if (i>1) Onset[i][v]=(Onset[i-1][v]+Dur[i-1][v]);
+	  BestFit[i][v]=((r->Best[0][v-1][i-1] == NoPitch) ? 0 : (r->Best[0][v-1][i-1]+Final));
+	  BestFit1[i][v]=((r->Best[1][v-1][i-1] == NoPitch) ? 0 : (r->Best[1][v-1][i-1]+Final));
+	  BestFit2[i][v]=((r->Best[2][v-1][i-1] == NoPitch) ? 0 : (r->Best[2][v-1][i-1]+Final));
+	  Ctrpt[i][v]=(BestFit[i][v]-BasePitch);
+	}
     }
+  for (f=0;f<3;f++) Fits[f]=r->Fits[f];
+  BestFitPenalty=Fits[0];
+  ShowBestFit(v1);
+  return(1);
+}
 
-  /* penalize a skip to an octave */
-  if ((IntClass == Unison) && ((ASkip(MelInt)) || (ASkip(Other0-Other1)))) Val += SkipTo8vePenalty;
+/* record a solved job (only if something was found) */
+void SaveSolution(int v1, int Species)
+{
+  CacheKey k;
+  CacheRecord *r,*Slot;
+  unsigned int Hash,Seq;
+  int i,j,v,Final;
+  if ((!CacheWritable) || (BestFitPenalty >= infinity)) return;
+  Hash=MakeCacheKey(&k,v1,Species);
+  if (Hash == 0) return;
+  Final=(Ctrpt[TotalNotes[0]][0]+BasePitch);
+#ifdef THREADS
+  pthread_mutex_lock(&CacheLock);
+#endif
+  Slot=(CacheRecords+(Hash % CacheFile->Slots));
+  for (j=0;j<CacheProbes;j++)
+    {
+      r=(CacheRecords+((Hash+j) % CacheFile->Slots));
+      if ((r->Hash == 0) || ((r->Hash == Hash) && (memcmp((void *)&(r->Key),(void *)&k,sizeof(CacheKey)) == 0)))
+	{
+	  Slot=r;
+	  break;
+	}
+    }
+  Seq=RecordSeq(Slot);
+  if ((Seq & 1) || (!(__sync_bool_compare_and_swap(&(Slot->Seq),Seq,Seq+1))))	/* another process is writing it */
+    {
+#ifdef THREADS
+      pthread_mutex_unlock(&CacheLock);
+#endif
+      return;
+    }
+  Slot->Hash=0;
+  Slot->Key=k;
+  for (i=0;i<3;i++) Slot->Fits[i]=Fits[i];
+  memset((void *)Slot->Best,NoPitch,sizeof(Slot->Best));
+  for (v=1;v<=v1;v++)
+    {
+      Slot->TotalNotes[v-1]=TotalNotes[v];
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+	  Slot->Dur[v-1][i-1]=Dur[i][v];
+	  if (BestFit[i][v]) Slot->Best[0][v-1][i-1]=(BestFit[i][v]-Final);
+	  if (BestFit1[i][v]) Slot->Best[1][v-1][i-1]=(BestFit1[i][v]-Final);
+	  if (BestFit2[i][v]) Slot->Best[2][v-1][i-1]=(BestFit2[i][v]-Final);
+	}
+    }
+  Slot->Hash=Hash;
+  __sync_synchronize();
+  Slot->Seq=(Seq+2);
+#ifdef THREADS
+  pthread_mutex_unlock(&CacheLock);
+#endif
+}
 
-  /* do not skip from a unison (not a very important rule) */
-  if ((Other1 == LastCp) && (ASkip(MelInt))) Val += SkipFromUnisonPenalty;
+Local int SolveVoices,SolveSpecies,SolveBrLim,SolveStarts[MostVoices];	/* the last job, kept for Reharmonize */
+
+int PortfolioSpecies(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species, Strategy *Plans, int Count, double Seconds);
+Strategy DefaultPlans[] = {
+  {1.0, 0, 0, 0, 0},		/* exhaustive, so it can prove the others' best the best */
+  {0, 0, 0, 0, 0},		/* AnySpecies as usual */
+  {0, 0, 1, 0, 0},
+  {0.8, 100, 0, 0, 0},		/* quick and greedy */
+  {0, 0, 0, 17, 0},
+  {0, 0, 0, 0, 2}};
+double PortfolioSeconds = 0;	/* if set, AnySpecies runs DefaultPlans for at most this long */
+
+void AnySpecies(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species)
+{
+  int i,j,k,m,v,OldSpecies,CurrentMode,BrLim;
+  if ((PortfolioSeconds > 0) && (!(Plan)) && (!(Pulling)))
+    {
+      PortfolioSpecies(OurMode,StartPitches,CurV,CantusFirmusLength,Species,DefaultPlans,sizeof(DefaultPlans)/sizeof(Strategy),PortfolioSeconds);
+      SearchFloor=((PortfolioProved) ? BestFitPenalty : 0);
+      return;
+    }
+  for (i=0;i<MostNotes;i++)
+    for (j=1;j<MostVoices;j++)
+      {
+	BestFit[i][j]=0;
+	Ctrpt[i][j]=0;
+      }
+  PenaltyRatio=(1.0-(Species*CurV*.01));
+  BrLim=(50*(6-CurV)*(6-Species));
+  if (Plan)
+    {
+      if (Plan->Ratio > 0) PenaltyRatio=Plan->Ratio;
+      if (Plan->BrLim) BrLim=Plan->BrLim;
+    }
+  CurrentMode=OurMode;
+  Mode=OurMode;
+  TotalTime=((CantusFirmusLength-1)*8);
+  TotalNotes[0]=CantusFirmusLength;
+  BasePitch=((Ctrpt[CantusFirmusLength][0]) % 12);
+  BestFitPenalty=infinity;
+  MaxPenalty=infinity;
+  AllDone=0;
+  Branches=0;
+
+  for (i=1;i<=CantusFirmusLength;i++) 
+    {
+      Ctrpt[i][0] -= BasePitch;
+      Dur[i][0] = WholeNote;
+      Onset[i][0] = ((i-1)*8);
+    }
+  OldSpecies=Species;
+  for (v=1;v<=CurV;v++)
+    {
+      if (v != CurV) Species=1;
+      else Species = OldSpecies;
+      if (Species == 1)
+	{
+	  TotalNotes[v]=CantusFirmusLength;
+	  for (i=1;i<CantusFirmusLength;i++) Dur[i][v] = WholeNote;
+	}
+      else
+	if (Species == 2)
+	  {
+	    TotalNotes[v]=(CantusFirmusLength*2)-1;
+	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = HalfNote;
+	  }
+      else
+	if (Species == 3)
+	  {
+	    TotalNotes[v]=(CantusFirmusLength*4)-3;
+	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = QuarterNote;
+	  }
+      else
+	if (Species == 4)
+	  {
+	    TotalNotes[v]=(CantusFirmusLength*2)-1;
+	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = HalfNote;
+	  }
+      else
+	{
+	  CleanRhy();
+	  m=0;
+	  for (i=1;i<CantusFirmusLength;i++)
+	    {
+	      j=GoodRhy();
+	      UsedRhy(j);
+	      for (k=1;k<=(RhyNotes[j]);k++) Dur[k+m][v]=RhyPat[j][k];
+	      m += RhyNotes[j];
+	    }
+	  TotalNotes[v]=(m+1);
+	}
+      Dur[TotalNotes[v]][v]=WholeNote;
+      Onset[1][v]=0;
+      for (k=2;k<=TotalNotes[v];k++) Onset[k][v]=(Onset[k-1][v]+Dur[k-1][v]);
+      Ctrpt[1][v]=(StartPitches[v-1]-BasePitch);
+    }
+  ClearCarried();
+  if (CurV == 1) MaxPenalty=(2*RealBad); else MaxPenalty=infinity;
+  SolveVoices=CurV;
+  SolveSpecies=Species;
+  SolveBrLim=BrLim;
+  for (v=0;v<CurV;v++) SolveStarts[v]=StartPitches[v];
+  SpecializeCheck(CurV,Species);
+  UseHistory=((Plan) ? Plan->History : HistoryOrdering);
+  Shuffling=((Plan) && (Plan->Seed));
+  if (Shuffling) ShuffleCandidates(Plan->Seed);
+  if (UseHistory) ClearHistory();
+  StartBudget();
+  if ((Plan) || (Pulling) || (Budgeting))	/* the search itself is wanted, not the cache */
+    {
+      if ((Plan) && (Plan->Discrepancy)) {DiscrepancySearch(CurV,Species,BrLim,Plan->Discrepancy-1); NoteCut(0);}
+      else BestFitFirst(0,0,CurV,Species,BrLim);
+      EndBudget();
+      return;
+    }
+  if (CachedSolution(CurV,Species)) {SearchFloor=0; return;}	/* found by who knows what search */
+  if (LimitedDiscrepancy) {DiscrepancySearch(CurV,Species,BrLim,DiscrepancyBudget); NoteCut(0);}
+  else BestFitFirst(0,0,CurV,Species,BrLim);
+  EndBudget();
+  SaveSolution(CurV,Species);
+}
+
+/* Pulling solutions.  OpenSolutions sets up a job (Cantus holds its Length
+ * absolute pitches) without searching; each NextSolution then runs the search
+ * until it finds a better fit than the last and returns that fit's penalty
+ * (the fit itself is in BestFit, as after AnySpecies), or -1 once the search
+ * is over.  The search runs on its own stack in the caller's thread, stopped
+ * in SaveResults between calls, so the caller pays only for the search it
+ * asks for.  Below bounds the rest of the search: only fits under it are
+ * wanted (infinity for any better fit).  CloseSolutions abandons the search
+ * wherever it is.  The search's state is the thread's, so the iterator must
+ * be used on the thread that opened it, and while its search is stopped
+ * nothing else may be solved on that thread: SearchSuspended says so, and
+ * NextSolution on any other iterator returns -3 until that search is run
+ * out or closed.  Closed on another thread, an iterator is only marked,
+ * and its owner unwinds it the next time it asks SearchSuspended.
+ */
+
+#define SolutionStack (1 << 20)
+
+void PullSearch()
+{
+  SolutionIterator *it;
+  int i;
+  it=Pulling;
+  for (i=1;i<=it->Length;i++) Ctrpt[i][0]=it->Cantus[i-1];
+  for (i=0;i<3;i++) Fits[i]=0;
+  AnySpecies(it->Mode,it->StartPitches,it->Voices,it->Length,it->Species);
+  it->Finished=1;			/* back to the caller through uc_link */
+}
+
+SolutionIterator *OpenSolutions(int OurMode, int *StartPitches, int CurV, int *Cantus, int Length, int Species)
+{
+  SolutionIterator * volatile it;	/* getcontext returns twice, as setjmp does */
+  int i;
+  it=(SolutionIterator *)calloc(1,sizeof(SolutionIterator));
+  it->Stack=(char *)malloc(SolutionStack);
+  if ((it->Stack == NULL) || (getcontext(&(it->Search)) < 0))
+    {
+      free(it->Stack);
+      free(it);
+      return(NULL);
+    }
+  it->Search.uc_stack.ss_sp=it->Stack;
+  it->Search.uc_stack.ss_size=SolutionStack;
+  it->Search.uc_link=&(it->Caller);
+  makecontext(&(it->Search),PullSearch,0);
+  it->Mode=OurMode; it->Species=Species; it->Voices=CurV; it->Length=Length;
+  for (i=0;i<Length;i++) it->Cantus[i]=Cantus[i];
+  for (i=0;i<CurV;i++) it->StartPitches[i]=StartPitches[i];
+  it->Penalty=infinity;
+#ifdef THREADS
+  it->Owner=pthread_self();
+#endif
+  return(it);
+}
+
+int SearchSuspended();
+
+int OwnSolutions(SolutionIterator *it)
+{
+#ifdef THREADS
+  return(pthread_equal(it->Owner,pthread_self()));
+#else
+  return(1);
+#endif
+}
 
-  /* penalize skips followed or preceded by motion in same direction */
-  if ((Cn>2) && ((ASkip(MelInt)) && SameDir))
+/* -2 if it is not this thread's iterator, -3 if another's search is stopped on this thread */
+int NextSolution(SolutionIterator *it, int Below)
+{
+  if (!(OwnSolutions(it))) return(-2);
+  if (it->Finished) return(-1);
+  if ((Suspended != it) && (SearchSuspended())) return(-3);
+  it->Below=Below;
+  it->Started=1;
+  Pulling=it;
+  swapcontext(&(it->Caller),&(it->Search));
+  Pulling=NULL;
+  if (it->Finished)
     {
-      /* especially penalize fifths, sixths, and octaves of this sort */
-      if ((ABS(MelInt)) < Fifth) Val += SkipPrecededBySameDirectionPenalty;
-      else
-	{
-          if (((ABS(MelInt)) == Fifth) || ((ABS(MelInt)) == Octave)) 
-	    Val += FifthPrecededBySameDirectionPenalty;
-	  else Val += SixthPrecededBySameDirectionPenalty;
-	}
+      Suspended=NULL;
+      BestFitPenalty=it->Penalty;	/* Below may have been left there */
+      return(-1);
     }
-  if ((Cn>2) && ((ASkip(LastMelInt)) && SameDir))
+  Suspended=it;
+  it->Penalty=BestFitPenalty;
+  return(it->Penalty);
+}
+
+/* 0, or -2 if a running search could only be left for its own thread to unwind */
+int CloseSolutions(SolutionIterator *it)
+{
+  if ((it->Started) && (!(it->Finished)))
     {
-      if ((ABS(LastMelInt)) < Fifth) Val += SkipFollowedBySameDirectionPenalty;
-      else
+      if (!(OwnSolutions(it)))
 	{
-          if (((ABS(LastMelInt)) == Fifth) || ((ABS(LastMelInt)) == Octave))
-            Val += FifthFollowedBySameDirectionPenalty;
-          else Val += SixthFollowedBySameDirectionPenalty;
+	  it->Orphaned=1;
+	  __sync_synchronize();
+	  return(-2);
 	}
+      it->Abandoned=1;
+      NextSolution(it,infinity);	/* unwinds the search, freeing what it holds */
     }
+  free(it->Stack);
+  free(it);
+  return(0);
+}
 
-  /* too many skips in a row -- favor a mix of steps and skips */
-    if ((Cn>4) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (ASkip(LastCp2-LastCp3))))) Val += MelodicBoredomPenalty;
-
-  /* avoid tritones melodically */
-  if ((Cn>4) && (((ABS(Cp-LastCp2)) == Tritone) || (((ABS(Cp-LastCp3)) == Tritone) || ((ABS(Cp-LastCp4)) == Tritone))))
-    Val += MelodicTritonePenalty;
+/* is some iterator's search stopped on this thread (so nothing else can be solved here)? */
+int SearchSuspended()
+{
+  if ((Suspended) && (Suspended->Orphaned)) CloseSolutions(Suspended);
+  return(Suspended != NULL);
+}
 
-  /* do not allow movement from a tenth to an octave by contrary motion */
-  if ((Species != 5) && (NumParts == 1))
-    {
-      if (ATenth(Other1-LastCp) && (AnOctave(Interval))) Val += TenthToOctavePenalty;
-    }
+void PinNote(int n, int v, int Pitch) {Pinned[n][v]=Pitch;}
+void ClearPins() {int i,v; for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) Pinned[i][v]=0;}
 
-  /* more range checks -- did we go over an octave recently */
-  if ((Cn>2) && ((ABS(Cp-LastCp2)) > Octave)) Val += OverOctavePenalty;
+/* Incremental re-solve after a local edit.  Everything the last solve
+ * found outside Window bars on either side of EditTime is pinned to the
+ * old best fit, and the search (which then has only one candidate at
+ * those onsets) is bounded by a little more than the old best penalty.
+ * If nothing closes the window under that bound, we fall back on a full
+ * solve.  Returns 1 if the windowed search sufficed.
+ */
 
-  /* same for a twelfth */
-  if (((Cn>30) || (Species != 5)) && (TotalRange(Cn,Cp,v) > (Octave+Fifth))) Val += OverTwelfthPenalty;
-  if (Val >= CurLim) return(Val);
+float ReharmonizeRatio = 1.25;
 
-  /* slightly penalize repeated notes */
-  if ((Cn>3) && ((Cp == LastCp2) && (LastCp == LastCp3))) Val += TwoRepeatedNotesPenalty;
-  if ((Cn>5) && ((Cp == LastCp3) && ((LastCp == LastCp4) && (LastCp2 == Us(Cn-5,v))))) Val += ThreeRepeatedNotesPenalty;
-  if ((Cn>6) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) && (LastCp2 == Us(Cn-6,v))))) Val += (ThreeRepeatedNotesPenalty-1);
-  if ((Cn>7) && ((Cp == LastCp4) && ((LastCp == Us(Cn-5,v)) &&
-       ((LastCp2 == Us(Cn-6,v)) && (LastCp3 == Us(Cn-7,v)))))) Val += FourRepeatedNotesPenalty;
-  if ((Cn>8) && ((Cp == Us(Cn-5,v)) && ((LastCp == Us(Cn-6,v)) &&
-      ((LastCp2 == Us(Cn-7,v)) && (LastCp3 == Us(Cn-8,v)))))) Val += FourRepeatedNotesPenalty;
-  if (LastNote(Cn,v))
+int Reharmonize(int EditTime, int Window)
+{
+  int i,v,Bound,Lo,Hi,Found;
+  int UserPins[MostNotes][MostVoices];
+  Found=0;
+  if (BestFitPenalty < infinity)
     {
-      LastPitch=(LastCp % 12);
-      if (((LastPitch == 11) || ((LastPitch == 10) && (Mode == Phrygian))) && (Pitch != 0)) Val += UnresolvedLeadingTonePenalty;
+      for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) UserPins[i][v]=Pinned[i][v];
+      Lo=(EditTime-(Window*WholeNote));
+      Hi=(EditTime+(Window*WholeNote));
+      for (v=1;v<=SolveVoices;v++)
+	for (i=2;i<=TotalNotes[v];i++)
+	  {
+	    if ((Pinned[i][v] == 0) && ((Onset[i][v] < Lo) || (Onset[i][v] > Hi))) Pinned[i][v]=BestFit[i][v];
+	  }
+      Bound=((int)(BestFitPenalty*ReharmonizeRatio))+1;
+      BestFitPenalty=Bound;
+      MaxPenalty=Bound;
+      PenaltyRatio=(1.0-(SolveSpecies*SolveVoices*.01));
+      AllDone=0;
+      Branches=0;
+      SoundAll(SolveVoices);	/* the cantus edit, or a cached fit, went straight into Ctrpt */
+      BestFitFirst(0,0,SolveVoices,SolveSpecies,SolveBrLim);
+      Found=(BestFitPenalty < Bound);
+      for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) Pinned[i][v]=UserPins[i][v];
     }
-  if (Val >= CurLim) return(Val);
-
-  /* an imperfect consonance is better than a perfect consonance */
-  if (PerfectConsonance[IntClass]) Val += PerfectConsonancePenalty;
+  if (!Found)
+    {
+      for (i=1;i<=TotalNotes[0];i++) Ctrpt[i][0] += BasePitch;
+      AnySpecies(Mode,SolveStarts,SolveVoices,TotalNotes[0],SolveSpecies);
+    }
+  return(Found);
+}
 
-  /* no unisons allowed within counterpoint unless more than 2 parts */
-  if ((NumParts == 1) && (Interval == Unison)) Val += UnisonPenalty;
-  if (Val >= CurLim) return(Val);
+/* change cantus note n to (absolute) Pitch and re-solve around it */
+int EditCantus(int n, int Pitch, int Window)
+{
+  Ctrpt[n][0]=(Pitch-BasePitch);
+  if (n == TotalNotes[0]) BestFitPenalty=infinity;	/* the final sets BasePitch, so start over */
+  return(Reharmonize(Onset[n][0],Window));
+}
 
-  /* seek variety by avoiding pitch repetitions */
-  Val += (PitchRepeats(Cn,Cp,v)>>1);
+/* SLIDING-HORIZON SOLVER
+ *
+ * StreamSpecies harmonizes a cantus of any length a window at a time.  It
+ * solves the next Window bars (and the downbeat after them, as somewhere to
+ * go) behind the bars holding the last StreamHistory committed notes, which
+ * are pinned and, being settled, not scored again.  Then it commits the first
+ * Commit bars of the best fit, hands them to Handler, and slides on.  The
+ * range, pitch repetitions, interval counts and crossings of notes that have
+ * scrolled out of view are carried into the rules, and the cadence rules apply
+ * only in the window holding the final.  The cantus comes from Next a note at
+ * a time (0 ends it), so memory is bounded by the window.
+ * Returns the number of bars committed, or -1 if some window had no solution.
+ */
 
-  /* penalize octave leaps a little */
-  if (AnOctave(MelInt)) Val += OctaveLeapPenalty;
+#define StreamHistory 4		/* notes, as far back as any rule looks */
+#define MostHistory 4		/* bars those can take */
 
-  /* similarly for minor sixth leaps */
-  if (MelInt == MinorSixth) Val += SixthLeapPenalty;
+typedef int (*CantusSource)(void *Data);
+typedef void (*StreamHandler)(int v, int Bar, int *Pitches, int *Durs, int Count, void *Data);
 
-  /* penalize upper neighbor notes slightly (also lower neighbors) */
-  if ((Cn>2) && ((MelInt<0) && ((AStep(MelInt)) && (Cp == LastCp2)))) Val += UpperNeighborPenalty;
-  if ((Cn>2) && ((MelInt>0) && ((AStep(MelInt)) && (Cp == LastCp2)))) Val += LowerNeighborPenalty;
+typedef struct {int Pitch, Dur, Bar, Side;} StreamNote;
 
-  /* do not allow normal leading tone to precede raised leading tone */
-  /* also check here for augmented fifths and diminished fourths */
-  if ((!(InMode(Pitch,Mode))) && ((MelInt == MinorSecond) || ((MelInt == MinorSixth) || (MelInt == (-MajorThird))))) Val += OutOfModePenalty;   
+int BarRhythm(int Species, int Pattern, int *Durs)
+{
+  int i,n;
+  switch (Species)
+    {
+    case 1: Durs[0]=WholeNote; return(1);
+    case 3: for (i=0;i<4;i++) Durs[i]=QuarterNote; return(4);
+    case 5: n=RhyNotes[Pattern]; for (i=0;i<n;i++) Durs[i]=RhyPat[Pattern][i+1]; return(n);
+    default: Durs[0]=HalfNote; Durs[1]=HalfNote; return(2);
+    }
+}
 
-  /* slightly frown upon leap back in the opposite direction */
-  if ((Cn>2) && ((ASkip(MelInt)) && ((ASkip(LastMelInt)) && (!(SameDir)))))
+int StreamSpecies(int OurMode, int Final, int *StartPitches, int CurV, int Species, int Window, int Commit,
+		  CantusSource Next, void *Source, StreamHandler Handler, void *Data)
+{
+  int Firmus[MostNotes];			/* the cantus from bar First on */
+  int Pattern[MostNotes];			/* species 5 rhythms from bar Start on */
+  StreamNote Kept[MostVoices][MostNotes];	/* committed notes still in view */
+  int KeptCount[MostVoices],LastGone[MostVoices],GoneSide[MostVoices],GoneCross[MostVoices];
+  int GoneIntervals[MostVoices][17];
+  int Pitches[MostNotes],Durs[MostNotes];
+  int First,Start,End,Have,Patterns,Ended,IsFinal,Bars,From,OldShow,i,j,k,n,b,v,p,BrLim;
+  StreamNote *x;
+  if ((CurV < 1) || (CurV >= MostVoices)) return(-1);
+  Window=MAX(1,MIN(Window,((MostNotes-2)/((Species == 5) ? 6 : 4))-MostHistory-1));
+  Commit=MAX(1,MIN(Commit,Window));
+  Mode=OurMode;
+  BasePitch=(Final % 12);
+  PenaltyRatio=(1.0-(Species*CurV*.01));
+  BrLim=(50*(6-CurV)*(6-Species));
+  ClearPins();
+  for (v=0;v<MostVoices;v++) TotalNotes[v]=0;
+  ClearCarried();
+  for (v=1;v<=CurV;v++)
     {
-      Val += (MAX(0,((ABS(MelInt)+ABS(LastMelInt))-8)));
-      if ((Cn>3) && (ASkip(LastCp2-LastCp3))) Val += ThreeSkipsPenalty;
+      KeptCount[v]=0; LastGone[v]=0; GoneSide[v]=0; GoneCross[v]=0;
+      for (k=0;k<17;k++) GoneIntervals[v][k]=0;
     }
+  CleanRhy();
+  OldShow=ShowFits;
+  ShowFits=0;
+  First=0; Start=0; Have=0; Patterns=0; Ended=0;
+  while (1)
+    {
+      /* read through the end of the window and one bar past it */
+      while ((!Ended) && (Have < ((Start-First)+Window+2)))
+	{
+	  p=(*Next)(Source);
+	  if (p == 0) Ended=1; else Firmus[Have++]=p;
+	}
+      if ((First+Have) < 2) break;
+      End=MIN(Start+Window,First+Have-1);
+      IsFinal=(Ended && (End == (First+Have-1)));
+      while (Patterns < (End-Start))
+	{
+	  j=0;
+	  if (Species == 5) {j=GoodRhy(); UsedRhy(j);}
+	  Pattern[Patterns++]=j;
+	}
 
-  /* try to approach cadential passages by step */
-  if ((NumParts == 1) && ((Cn >= (TotalNotes[v]-4)) && ((ABS(MelInt)) > 4))) Val += LeapAtCadencePenalty;
+      /* set up the window as a piece of its own, the history pinned in front */
+      TotalTime=((End-First)*8);
+      TotalNotes[0]=(End-First+1);
+      EndNotes[0]=(IsFinal ? TotalNotes[0] : MostNotes+8);
+      for (i=1;i<=TotalNotes[0];i++)
+	{
+	  Ctrpt[i][0]=(Firmus[i-1]-BasePitch);
+	  Dur[i][0]=WholeNote;
+	  Onset[i][0]=((i-1)*8);
+	}
+      ClearPins();
+      for (v=1;v<=CurV;v++)
+	{
+	  n=0;
+	  for (i=0;i<KeptCount[v];i++)
+	    {
+	      n++;
+	      Ctrpt[n][v]=(Kept[v][i].Pitch-BasePitch);
+	      Dur[n][v]=Kept[v][i].Dur;
+	      if (n > 1) Pinned[n][v]=Kept[v][i].Pitch;
+	    }
+	  if (n == 0) Ctrpt[1][v]=(StartPitches[v-1]-BasePitch);
+	  SettledNotes[v]=n;
+	  for (b=Start;b<End;b++)
+	    {
+	      k=BarRhythm((v == CurV) ? Species : 1,Pattern[b-Start],Durs);
+	      for (i=0;i<k;i++) Dur[++n][v]=Durs[i];
+	    }
+	  Dur[++n][v]=WholeNote;
+	  TotalNotes[v]=n;
+	  EndNotes[v]=(IsFinal ? n : MostNotes+8);
+	  Onset[1][v]=0;
+	  for (k=2;k<=n;k++) Onset[k][v]=(Onset[k-1][v]+Dur[k-1][v]);
+	  for (k=0;k<17;k++) CarriedIntervals[v][k]=GoneIntervals[v][k];
+	  CarriedCross[v]=GoneCross[v];
+	  if ((LastGone[v]) && (KeptCount[v]))	/* the step from the last note gone to the first in view */
+	    {
+	      CarriedIntervals[v][Size(Kept[v][0].Pitch-LastGone[v])+8]++;
+	      if ((NotesBefore[v] >= 3) && ((GoneSide[v]*Kept[v][0].Side) < 0)) CarriedCross[v]++;
+	    }
+	}
 
-  /* check for entangled voices */
-  Cross=0;
-  if (NumParts == 1)
-    {
-      for (k=4;k<=Cn;k++)
+      SpecializeCheck(CurV,Species);
+      UseHistory=HistoryOrdering;
+      Shuffling=0;
+      if (UseHistory) ClearHistory();
+      for (i=0;i<2;i++)		/* if the usual bound finds nothing, try again without it */
 	{
-          if ((Us(k,v)-Cantus(k,v))*(Us(k-1,v)-Cantus(k-1,v)) < 0) Cross++;
+	  BestFitPenalty=infinity;
+	  MaxPenalty=(((i == 0) && (CurV == 1)) ? (2*RealBad) : infinity);
+	  AllDone=0;
+	  Branches=0;
+	  BestFitFirst(0,0,CurV,Species,BrLim);
+	  if (BestFitPenalty < infinity) break;
+	}
+      if (BestFitPenalty >= infinity)
+	{
+	  Start=-1;
+	  break;
 	}
-    }
-  if (Cross > 0) Val += (MAX(0,((Cross-2)*3)));
-  
-  /* don't repeat note on upbeat */
-  if (UpBeat(Cn,v) && (MelInt == Unison)) Val += RepetitionOnUpbeatPenalty;
- 
-  /* avoid tritones near Lydian cadence */
-  if ((Mode == Lydian) && ((Cn>(TotalNotes[v]-4)) && (Pitch == 6))) Val += LydianCadentialTritonePenalty;
 
-  /* various miscellaneous checks.  More elaborate dissonance resolution and cadential formula checks will be given under "Species definition" */
-  if ((Species != 1) && (DownBeat(Cn,v)))
-    {
-      if (Species<4)
+      /* commit the first bars (all of them at the end) and pass them on */
+      Bars=(IsFinal ? (End-Start+1) : MIN(Commit,End-Start));
+      From=((Start-First)*8);
+      for (v=1;v<=CurV;v++)
 	{
-	  if ((MelInt == Unison) && (!(LastNote(Cn,v)))) Val += UnisonDownbeatPenalty;
-	  /* check for dissonance that doesn't fill a third as a passing tone */
-	  if ((Dissonance[LastIntClass]) && ((!(AStep(MelInt))) || (!(SameDir)))) Val += DissonanceNotFillingThirdPenalty;
+	  k=0;
+	  for (i=1;i<=TotalNotes[v];i++)
+	    if ((Onset[i][v] >= From) && ((IsFinal) || (Onset[i][v] < (From+(Bars*8)))))
+	      {
+		x=&Kept[v][KeptCount[v]++];
+		x->Pitch=BestFit[i][v];
+		x->Dur=Dur[i][v];
+		x->Bar=(First+(Onset[i][v] >> 3));
+		x->Side=(BestFit[i][v]-(Cantus(i,v)+BasePitch));
+		Pitches[k]=x->Pitch;
+		Durs[k++]=x->Dur;
+	      }
+	  (*Handler)(v,Start,Pitches,Durs,k,Data);
 	}
+      Start += Bars;
+      if (IsFinal) break;
 
-      /* check for Direct 8ve or 5 where the intervening interval is less than a fourth */
-      if ((DirectMotionToPerfectConsonance(LastCp2,Cp,Other2,Other0)) && ((ABS(LastMelInt)) < Fourth))
-	Val += DirectPerfectOnDownbeatPenalty;
+      /* slide: keep the bars holding each voice's last StreamHistory notes, and put
+       * the notes before them into the carried counts
+       */
+      b=Start;
+      for (v=1;v<=CurV;v++) b=MIN(b,(KeptCount[v] < StreamHistory) ? First : Kept[v][KeptCount[v]-StreamHistory].Bar);
+      for (v=1;v<=CurV;v++)
+	{
+	  for (j=0;(j<KeptCount[v]) && (Kept[v][j].Bar < b);j++)
+	    {
+	      x=&Kept[v][j];
+	      if (LastGone[v]) GoneIntervals[v][Size(x->Pitch-LastGone[v])+8]++;
+	      if ((NotesBefore[v] >= 3) && ((GoneSide[v]*x->Side) < 0)) GoneCross[v]++;
+	      if (NotesBefore[v] == 0) CarriedBelow[v]=(x->Side < 0);
+	      if ((x->Pitch > 0) && (x->Pitch < MostNotes)) CarriedPitches[v][x->Pitch]++;
+	      CarriedLow[v]=((CarriedLow[v]) ? MIN(CarriedLow[v],x->Pitch) : x->Pitch);
+	      CarriedHigh[v]=MAX(CarriedHigh[v],x->Pitch);
+	      LastGone[v]=x->Pitch;
+	      GoneSide[v]=x->Side;
+	      NotesBefore[v]++;
+	    }
+	  for (i=j;i<KeptCount[v];i++) Kept[v][i-j]=Kept[v][i];
+	  KeptCount[v] -= j;
+	}
+      for (i=b-First;i<Have;i++) Firmus[i-(b-First)]=Firmus[i];
+      Have -= (b-First);
+      First=b;
+      for (i=Bars;i<Patterns;i++) Pattern[i-Bars]=Pattern[i];
+      Patterns=MAX(0,Patterns-Bars);
     }
+  ShowFits=OldShow;
+  ClearPins();
+  ClearCarried();
+  return(Start);
+}
 
-  /* check for tritone with cantus or bass */
-  if (IntClass == Tritone) Val += VerticalTritonePenalty;
+/* Batch modes hand out job numbers 0..Count-1 to Threads workers (just one without THREADS) */
 
-  /* check for melodic interval variety */
-  if ((Cn>10) && (TooMuchOfInterval(Cn,Cp,v))) Val += MelodicBoredomPenalty;
+int Threads = 1;
 
-  return(Val);
-}
+typedef void (*JobFunction)(int Job, void *Data);
 
+#ifdef THREADS
+typedef struct {int Next, Count; JobFunction Job; void *Data; pthread_mutex_t Lock;} JobQueue;
 
-int BestFit[MostNotes][MostVoices];
-int BestFit1[MostNotes][MostVoices]; /* next-to-best fits (for testing) */
-int BestFit2[MostNotes][MostVoices];
-int Fits[3];
-int BestFitPenalty,MaxPenalty,Branches,AllDone;
-float PenaltyRatio;
+void *Worker(void *arg)
+{
+  JobQueue *q = (JobQueue *)arg;
+  int Job;
+  FillRhyPat();		/* each thread has its own rhythm patterns */
+  while (1)
+    {
+      pthread_mutex_lock(&q->Lock);
+      Job=q->Next++;
+      pthread_mutex_unlock(&q->Lock);
+      if (Job >= q->Count) break;
+      (*(q->Job))(Job,q->Data);
+    }
+  return(NULL);
+}
 
-#define NumFields 16
-#define Field (MostVoices+1)
-#define EndF (Field*NumFields)
+void RunJobs(int Count, JobFunction Job, void *Data)
+{
+  int i,n;
+  pthread_t Ids[64];
+  JobQueue q;
+  q.Next=0; q.Count=Count; q.Job=Job; q.Data=Data;
+  pthread_mutex_init(&q.Lock,NULL);
+  n=MAX(1,MIN(Threads,MIN(Count,64)));
+  for (i=0;i<n;i++) pthread_create(&Ids[i],NULL,Worker,(void *)&q);
+  for (i=0;i<n;i++) pthread_join(Ids[i],NULL);
+  pthread_mutex_destroy(&q.Lock);
+}
 
-int SaveIndx(int indx, int *Sp)
+void LockOutput() {flockfile(stdout);}
+void UnlockOutput() {funlockfile(stdout);}
+#else
+void RunJobs(int Count, JobFunction Job, void *Data)
 {
   int i;
-  /* if INDX is less than current NUMFIELD-th worst,
-   * find its position in SP, insert space for its
-   * data, and return a pointer to the block.  The
-   * blocks are stored "backwards" for (SAIL's) ARRBLT 
-   */
-  i=EndF;
-  while ((i>=0) && (Sp[i]<=indx)) {i-=Field;}
-  if (i>0)	/* 0 is the end of the list.  If i>0 then we insert INDX */
-    {
-      ARRBLT(Sp,(int *)(Sp+Field),i);
-      Sp[i]=indx;
-      /* SP[i]=penalty for block starting at I.  SP[i-1]=index into
-       * melodic interval array for voice 1, SP[i-2] for voice 2 and
-       * so on.  The searcher starts at SP[EndF] and works backwards
-       * through the stored continuations as it searches for a satisfactory
-       * overall solution 
-       */
-    }
-  return(i);
+  for (i=0;i<Count;i++) (*Job)(i,Data);
 }
 
-void SaveResults(int CurrentPenalty, int Penalty, int v1, int Species)
+void LockOutput() {}
+void UnlockOutput() {}
+#endif
+
+/* Portfolio solve.  PortfolioSpecies runs the job once per Strategy, all at
+ * once on threads of their own (one after another without THREADS, each
+ * with an even share of the time left), every one bounded by the best
+ * penalty any of them has found so far.  A strategy with a Ratio of 1 that
+ * gets to the end has proved that best the best the search can find (the
+ * NumFields best continuations at each onset), and the others are stopped;
+ * otherwise they all stop once Seconds have passed (if none has found
+ * anything by then, the others go on until they do or give up).  Returns
+ * the winning strategy's index (-1 if none found anything) and leaves its
+ * fit where AnySpecies would.  PortfolioProved says whether it is known to
+ * be optimal.
+ */
+
+void PortfolioJob(int Job, void *Data)
 {
-  int i,LastPitch,v,Cn,k,Pitch,done;
-  for (v=1;v<=v1;v++)
+  Portfolio *p = (Portfolio *)Data;
+  int i,v,Finished;
+  for (i=1;i<=p->Length;i++) Ctrpt[i][0]=p->Cantus[i];
+  Running=p;
+  Plan=(p->Plans+((p->Starts) ? 0 : Job));
+  randx=(p->Rand+Job);
+  PlanPolls=0;
+#ifdef THREADS
+  PlanDeadline=p->End;
+#else
+  PlanDeadline=(Now()+((p->End-Now())/(p->Count-Job)));
+#endif
+  AllDone=0;
+  AnySpecies(p->Mode,((p->Starts) ? p->Starts[Job] : p->StartPitches),p->Voices,p->Length,p->Species);
+  Finished=((Plan->Ratio >= 1.0) && (!(Plan->Discrepancy)) && (!(AllDone)));
+  Plan=NULL;
+  Running=NULL;
+#ifdef THREADS
+  pthread_mutex_lock(&p->Lock);
+#endif
+  if (Finished)
     {
-      /* check all voices for raised leading tone */
-      Cn=TotalNotes[v];
-      LastPitch=(Us(Cn-1,v) % 12);	/* must be raised if any are */
-      if (!(InMode(LastPitch,Mode)))    /* it is a raised leading tone */
-	{
-	  k=2;
-	  while (1)                     /* exit via break */
-	    {
-	      /* look backwards through voice's notes */
-	      if (k >= (Cn-1)) break;	                /* ran off start!! */
-              Pitch=(Us(Cn-k,v) % 12);	                /* current pitch */
-              if (((Pitch<8) && (Pitch != 0)) ||	/* not 6-7-1 scale degree anymore */
-                  (ASkip(Us(Cn-k+1,v)-Us(Cn-k,v))))     /* skip breaks drive to cadence */
-		break;
-              Pitch=ABS(Us(Cn-k,v)-Us(Cn-k-1,v));       /* interval with raised leading tone */
-              if ((Pitch == Fourth) || ((Pitch == Fifth) || ((Pitch == Unison) || (Pitch == Octave)))) break;
-	      /* don't create illegal melody */
-	      done = 0;
-	      i=0;
-	      while (i<=v1)             /* do others have unraised form? */
-		{
-		  if ((i != v) && (((Other(Cn-k,v,i)) % 12) == 11)) 
-		    {
-		      done = 1;
-		      break;
-		    }
-		  i++;
-		}
-	      if (done) break;
-	      if (((Us(Cn-1,v)-Us(Cn-k,v)) == MinorThird) || ((Us(Cn-1,v)-Us(Cn-k,v)) == MinorSecond))
-                SetUs(Cn-k,Us(Cn-k,v)+1,v);            /* raise it and maybe 6th degree too */
-	      k++;
-	    }
-	}
+      p->Proved=1;
+      p->Stop=1;
     }
-  BestFitPenalty=CurrentPenalty+Penalty;
-  MaxPenalty=MIN(BestFitPenalty*PenaltyRatio,MaxPenalty);
-/*  AllDone=1; */
-  Fits[2]=Fits[1]; Fits[1]=Fits[0]; Fits[0]=BestFitPenalty;
-  for (v=1;v<=v1;v++)
+  if (BestFitPenalty < p->Penalty)
     {
-      for (i=1;i<=TotalNotes[v];i++)
+      p->Winner=Job;
+      p->Penalty=BestFitPenalty;
+      p->BasePitch=BasePitch;
+      p->TotalTime=TotalTime;
+      for (i=0;i<3;i++) p->Fits[i]=Fits[i];
+      for (v=1;v<=p->Voices;v++)
 	{
- 	  BestFit2[i][v]=BestFit1[i][v];       
- 	  BestFit1[i][v]=BestFit[i][v];        
-	  BestFit[i][v]=Ctrpt[i][v]+BasePitch; 
+	  p->TotalNotes[v]=TotalNotes[v];
+	  for (i=1;i<=TotalNotes[v];i++)
+	    {
+	      p->Best[0][i][v]=BestFit[i][v];
+	      p->Best[1][i][v]=BestFit1[i][v];
+	      p->Best[2][i][v]=BestFit2[i][v];
+	      p->Dur[i][v]=Dur[i][v];
+	      p->Onset[i][v]=Onset[i][v];
+	    }
 	}
     }
-#ifndef CM
-  printf("\n [%d] ",BestFitPenalty);
-  for (v=1;v<=v1;v++)
+#ifdef THREADS
+  pthread_mutex_unlock(&p->Lock);
+#endif
+}
+
+#ifdef THREADS
+void *PortfolioWorker(void *arg)
+{
+  FillRhyPat();
+  PortfolioJob(__sync_fetch_and_add(&(((Portfolio *)arg)->Next),1),arg);
+  return(NULL);
+}
+#endif
+
+Portfolio *NewPortfolio(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species, Strategy *Plans, int Count, double Seconds)
+{
+  Portfolio *p;
+  int i,v;
+  p=(Portfolio *)calloc(1,sizeof(Portfolio));
+  p->Mode=OurMode; p->Species=Species; p->Voices=CurV; p->Length=CantusFirmusLength;
+  p->Count=Count;
+  for (i=1;i<=CantusFirmusLength;i++) p->Cantus[i]=Ctrpt[i][0];
+  for (v=0;v<CurV;v++) p->StartPitches[v]=StartPitches[v];
+  p->Plans=Plans;
+  p->Rand=randx;
+  p->End=(Now()+Seconds);
+  p->Bound=infinity;
+  p->Winner=-1;
+  p->Penalty=infinity;
+#ifdef THREADS
+  pthread_mutex_init(&p->Lock,NULL);
+#endif
+  return(p);
+}
+
+/* leave the winner's fit where AnySpecies would, free p, and return the winner */
+int EndPortfolio(Portfolio *p)
+{
+  int i,v,Winner,CurV,Length;
+  Winner=p->Winner;
+  CurV=p->Voices;
+  Length=p->Length;
+  PortfolioProved=p->Proved;
+  SolveVoices=CurV;
+  SolveSpecies=p->Species;
+  SolveBrLim=(50*(6-CurV)*(6-p->Species));
+  for (v=0;v<CurV;v++) SolveStarts[v]=(((p->Starts) && (Winner >= 0)) ? p->Starts[Winner][v] : p->StartPitches[v]);
+  for (i=1;i<=Length;i++) Ctrpt[i][0]=p->Cantus[i];
+  Mode=p->Mode;
+  AllDone=0;
+  BestFitPenalty=p->Penalty;
+  if (Winner >= 0)
     {
-      for (i=1;i<=TotalNotes[v];i++)
+      BasePitch=p->BasePitch;
+      TotalTime=p->TotalTime;
+      TotalNotes[0]=Length;
+      for (i=1;i<=Length;i++) Ctrpt[i][0] -= BasePitch;
+      for (i=0;i<3;i++) Fits[i]=p->Fits[i];
+      for (v=1;v<=CurV;v++)
 	{
-	  printf("%d ",BestFit[i][v]);
+	  TotalNotes[v]=p->TotalNotes[v];
+	  for (i=1;i<=TotalNotes[v];i++)
+	    {
+	      BestFit[i][v]=p->Best[0][i][v];
+	      BestFit1[i][v]=p->Best[1][i][v];
+	      BestFit2[i][v]=p->Best[2][i][v];
+	      Dur[i][v]=p->Dur[i][v];
+	      Onset[i][v]=p->Onset[i][v];
+	      Ctrpt[i][v]=(BestFit[i][v]-BasePitch);
+	    }
 	}
-      printf("\n");
+      ShowBestFit(CurV);
     }
+#ifdef THREADS
+  pthread_mutex_destroy(&p->Lock);
+#endif
+  free(p);
+  return(Winner);
+}
+
+int PortfolioSpecies(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species, Strategy *Plans, int Count, double Seconds)
+{
+  Portfolio *p;
+  int i;
+#ifdef THREADS
+  pthread_t Ids[MostStrategies];
 #endif
+  p=NewPortfolio(OurMode,StartPitches,CurV,CantusFirmusLength,Species,Plans,MIN(Count,MostStrategies),Seconds);
+#ifdef THREADS
+  for (i=0;i<p->Count;i++) pthread_create(&Ids[i],NULL,PortfolioWorker,(void *)p);
+  for (i=0;i<p->Count;i++) pthread_join(Ids[i],NULL);
+#else
+  for (i=0;i<p->Count;i++) PortfolioJob(i,(void *)p);
+#endif
+  return(EndPortfolio(p));
 }
 
-int Indx[17] = {0,1,-1,2,-2,3,-3,0,4,-4,5,7,-5,8,12,-7,-12};
+/* Start pitch selection.  ChooseStarts solves the job from each likely set
+ * of start pitches (see StartSets), as jobs on Threads workers bounded by
+ * the best penalty any has found so far, and puts the winner's start
+ * pitches in StartPitches.  The candidates for each voice are the final,
+ * its fifth, and (with three or more parts) the mode's third, within a
+ * twelfth of the cantus' first note and out of the extreme range.  The
+ * lowest part must begin on the final, and (with more than one voice) no
+ * two voices on the same pitch.  Of those sets the MostStarts closest to
+ * the cantus are tried.  Returns the winning set's index, or -1.
+ */
 
-int Look(int CurPen, int CurVoice, int NumParts, int Species, int Lim, int *Pens, int *Is, int *CurNotes)
+#define MostStarts 64
+
+/* returns how many sets it put in Sets, most compact first */
+int StartSets(int OurMode, int CurV, int CantusFirmusLength, int Sets[][MostVoices])
 {
-  int penalty,Pit,i,x,tmp1,NewLim;
-  NewLim=Lim;
-  for (Is[CurVoice]=1;Is[CurVoice]<=16;Is[CurVoice]++)
+  int i,j,v,p,First,Base,Rel,Lowest,Spread,Count,Ok;
+  int Pitches[4*Octave],Choices,At[MostVoices],Spreads[MostStarts];
+  First=Ctrpt[1][0];
+  Base=(Ctrpt[CantusFirmusLength][0] % 12);
+  Choices=0;
+  for (p=(First-(Octave+Fifth));p<=(First+Octave+Fifth);p++)
     {
-      Pit=Indx[Is[CurVoice]]+Ctrpt[CurNotes[CurVoice]-1][CurVoice];
-      if (CurVoice == NumParts) tmp1=Species; else tmp1=1;
-      penalty=CurPen+Check(CurNotes[CurVoice],Pit,CurVoice,NumParts,tmp1,NewLim);
-      SetUs(CurNotes[CurVoice],Pit,CurVoice);
-      if (penalty<NewLim)
+      if (ExtremeRange(p)) continue;
+      Rel=((p-Base+Octave) % 12);
+      if ((Rel == Unison) || (Rel == Fifth) ||
+	  ((CurV > 1) && ((Rel == MinorThird) || (Rel == MajorThird)) && (InMode(Rel,OurMode))))
+	Pitches[Choices++]=p;
+    }
+  if (Choices == 0) return(0);
+  Count=0;
+  for (v=0;v<CurV;v++) At[v]=0;
+  while (1)
+    {
+      Ok=1;
+      Lowest=First;
+      Spread=0;
+      for (v=0;v<CurV;v++)
 	{
-          if (CurVoice<NumParts)
-	    {
-	      i=(CurVoice+1);
-	      while (i<=NumParts)
-		{
-		  if (CurNotes[i] != 0) break;
-		  i++;
-		}
-              if (i <= NumParts)	/* there is another voice needing a note */
-                {
-		  NewLim=Look(penalty,i,NumParts,Species,NewLim,Pens,Is,CurNotes);
-		}
-	    }
-	  else
+	  p=Pitches[At[v]];
+	  Lowest=MIN(Lowest,p);
+	  Spread += ABS(p-First);
+	  for (i=0;i<v;i++) if (Pitches[At[i]] == p) Ok=0;
+	}
+      if (((Lowest-Base+Octave) % 12) != Unison) Ok=0;
+      if ((Ok) && ((Count < MostStarts) || (Spread < Spreads[Count-1])))
+	{
+	  if (Count < MostStarts) Count++;
+	  for (j=(Count-1);(j > 0) && (Spreads[j-1] > Spread);j--)
 	    {
-	      x=SaveIndx(penalty,Pens);
-	      if (x>0)
-		{
-		  for (i=1;i<=NumParts;i++) Pens[x-i]=Is[i];
-		}
-	      else NewLim=MIN(NewLim,penalty);
+	      Spreads[j]=Spreads[j-1];
+	      for (v=0;v<CurV;v++) Sets[j][v]=Sets[j-1][v];
 	    }
+	  Spreads[j]=Spread;
+	  for (v=0;v<CurV;v++) Sets[j][v]=Pitches[At[v]];
 	}
+      for (v=0;(v < CurV) && (++At[v] == Choices);v++) At[v]=0;
+      if (v == CurV) break;
     }
-  return(NewLim);
+  return(Count);
 }
 
-void BestFitFirst(int CurTime, int CurrentPenalty, int NumParts, int Species, int BrLim)
+Strategy StartPlan = {0, 0, 0, 0, 0};
+
+int ChooseStarts(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species)
 {
-  int i,j,CurMin,Lim,ChoiceIndex,NextTime,OurTime;
-  int *Pens,*Is,*CurNotes;
-  if ((AllDone) || (CurrentPenalty>MaxPenalty)) return;
+  Portfolio *p;
+  int v,Count,Winner,Sets[MostStarts][MostVoices];
+  Count=StartSets(OurMode,CurV,CantusFirmusLength,Sets);
+  if (Count == 0) return(-1);
+  p=NewPortfolio(OurMode,Sets[0],CurV,CantusFirmusLength,Species,&StartPlan,Count,infinity);
+  p->Starts=Sets;
+  RunJobs(Count,PortfolioJob,(void *)p);
+  Winner=EndPortfolio(p);
+  if (Winner >= 0) for (v=0;v<CurV;v++) StartPitches[v]=Sets[Winner][v];
+  return(Winner);
+}
 
-  Branches++;
-  Pens=(int *)calloc(1+(Field*NumFields),sizeof(int));
-  Is=(int *)calloc(1+NumParts,sizeof(int));
-  CurNotes=(int *)calloc(1+MostVoices,sizeof(int));
+/* SCORING
+ *
+ * ScoreSubmission runs the rules over counterpoint that already exists (a
+ * student's, or another program's) without any search.  Notes are checked in
+ * the order BestFitFirst sets them, onset by onset and voice by voice, so a
+ * solution the search found scores its BestFitPenalty; the first notes, being
+ * given, are not scored.  Notes SaveResults raised on the way to a leading
+ * tone are checked unraised, as the search saw them.  The result is the total
+ * and what each note and each rule (see RuleNames) charged, or -1 if the
+ * voices don't fit the cantus.  This takes over the solver's state, so
+ * ScoreSubmissions spreads a batch over Threads workers, each with its own.
+ */
 
-  ChoiceIndex=EndF;
-  AllDone=0;
-  for (i=0;i<=(Field*NumFields);i++) Pens[i]=infinity;
-  for (i=0;i<=NumParts;i++) Is[i]=0;
-  for (i=0;i<=MostVoices;i++) CurNotes[i]=0;
+typedef struct {
+  int Mode, Species, Voices, Length;	/* Species is the last voice's, the others are first species */
+  int Cantus[MostNotes];		/* Length absolute pitches, from 0 */
+  int Notes[MostVoices];		/* how many in each voice, from 1 (the bass) */
+  int Pitches[MostVoices][MostNotes];	/* [v][1..Notes[v]], absolute */
+  int Durs[MostVoices][MostNotes];	/* in eighths; the last note starts on the cantus' last */
+  int Penalty;
+  int NotePenalty[MostVoices][MostNotes];
+  int RulePenalty[NumberOfRules];
+} Submission;
 
-  if (Branches == BrLim) {MaxPenalty = MaxPenalty*PenaltyRatio; Branches=0;}
+#define ScoreLimit 0x7fffffff
 
-  CurMin=infinity;
-  Lim=BestFitPenalty-CurrentPenalty;
-  NextTime=infinity;
-  for (i=0;i<=NumParts;i++)
-    {
-      OurTime=Onset[VIndex(CurTime,i)+1][i];
-      if (OurTime != 0) NextTime=MIN(NextTime,OurTime);
-    }
-  for (i=1;i<=NumParts;i++)
+void LowerRaisedNotes(int v)
+{
+  int k,Cn,Pitch;
+  Cn=TotalNotes[v];
+  if ((Cn < 3) || (InMode(Us(Cn-1,v) % 12,Mode))) return;
+  for (k=2;k<(Cn-1);k++)
     {
-      j=VIndex(NextTime,i);
-      if (Onset[j][i] == NextTime) CurNotes[i]=j;
+      Pitch=(Us(Cn-k,v) % 12);
+      if ((Pitch < 8) && (Pitch != 0)) break;
+      if ((!(InMode(Pitch,Mode))) && (InMode(Pitch-1,Mode))) SetUs(Cn-k,Us(Cn-k,v)-1,v);
     }
-  i=1;
-  while (i<=NumParts)
+}
+
+int ScoreSubmission(Submission *s)
+{
+  int i,v,Time,Val,At[MostVoices];
+  long Total;
+  s->Penalty=-1;
+  if ((s->Length < 2) || (s->Length >= MostNotes) || (s->Voices < 1) || (s->Voices >= MostVoices) ||
+      (s->Species < 1) || (s->Species > 5)) return(-1);
+  Mode=s->Mode;
+  TotalTime=((s->Length-1)*8);
+  TotalNotes[0]=s->Length;
+  BasePitch=(s->Cantus[s->Length-1] % 12);
+  for (i=1;i<=s->Length;i++)
     {
-      if (CurNotes[i] != 0) break;
-      i++;
+      Ctrpt[i][0]=(s->Cantus[i-1]-BasePitch);
+      Dur[i][0]=WholeNote;
+      Onset[i][0]=((i-1)*8);
     }
-  Lim=Look(0,i,NumParts,Species,Lim,Pens,Is,CurNotes);
-
-  CurMin=Pens[ChoiceIndex];
-  if (CurMin < infinity)
+  for (v=1;v<=s->Voices;v++)
     {
-      AllDone=0;
-      while (!(AllDone))
+      if ((s->Notes[v] < 2) || (s->Notes[v] >= MostNotes)) return(-1);
+      TotalNotes[v]=s->Notes[v];
+      Onset[1][v]=0;
+      for (i=1;i<=TotalNotes[v];i++)
 	{
-	  if (CurTime<TotalTime)
-	    {
-	      if ((CurMin+CurrentPenalty) >= MaxPenalty) break;
-	    }
-	  else
-	    {
-	      if ((CurMin+CurrentPenalty) >= BestFitPenalty) break;
-	    }
-	  
-	  for (i=1;i<=NumParts;i++)
-	    {
-	      if (CurNotes[i] != 0) SetUs(CurNotes[i],Indx[Pens[ChoiceIndex-i]]+Us(CurNotes[i]-1,i),i);
-	    }
-	  if (NextTime<TotalTime)
-	    BestFitFirst(NextTime,CurrentPenalty+CurMin,NumParts,Species,BrLim);
-	  else
-	    SaveResults(CurrentPenalty,CurMin,NumParts,Species);
-	  
-	  ChoiceIndex=ChoiceIndex-Field;
-	  if (ChoiceIndex <= 0) break;
-	  CurMin=Pens[ChoiceIndex];
-	  if (CurMin == infinity) break;
-	  if (CurTime == 0) MaxPenalty=(BestFitPenalty*PenaltyRatio);
+	  Ctrpt[i][v]=(s->Pitches[v][i]-BasePitch);
+	  Dur[i][v]=s->Durs[v][i];
+	  if (i > 1) Onset[i][v]=(Onset[i-1][v]+Dur[i-1][v]);
+	  if ((Dur[i][v] <= 0) || (Ctrpt[i][v] < 0)) return(-1);
 	}
+      if (Onset[TotalNotes[v]][v] != TotalTime) return(-1);
+      LowerRaisedNotes(v);
+      At[v]=2;
     }
-
-  free(CurNotes);
-  free(Is);
-  free(Pens);
+  ClearCarried();
+  SpecializeCheck(s->Voices,s->Species);
+  for (i=0;i<NumberOfRules;i++) s->RulePenalty[i]=0;
+  for (v=0;v<MostVoices;v++) for (i=0;i<MostNotes;i++) s->NotePenalty[v][i]=0;
+  RuleTally=s->RulePenalty;
+  Total=0;
+  while (1)
+    {
+      Time=ScoreLimit;
+      for (v=1;v<=s->Voices;v++) if (At[v] <= TotalNotes[v]) Time=MIN(Time,Onset[At[v]][v]);
+      if (Time == ScoreLimit) break;
+      for (v=1;v<=s->Voices;v++)
+	if ((At[v] <= TotalNotes[v]) && (Onset[At[v]][v] == Time))
+	  {
+	    Val=VoiceCheck[v](At[v],Us(At[v],v),v,ScoreLimit);
+	    s->NotePenalty[v][At[v]]=Val;
+	    Total += Val;
+	    At[v]++;
+	  }
+    }
+  RuleTally=NULL;
+  s->Penalty=((Total < ScoreLimit) ? (int)Total : ScoreLimit);
+  return(s->Penalty);
 }
 
-int RhyPat[11][9],RhyNotes[11];
+void ScoreJob(int Job, void *Data) {ScoreSubmission(((Submission *)Data)+Job);}
+void ScoreSubmissions(Submission *Batch, int Count) {RunJobs(Count,ScoreJob,(void *)Batch);}
 
-void FillRhyPat()
+
+/* IMPROVEMENT
+ *
+ * ImproveSolution takes the last solve's best fit and repeatedly frees a
+ * window of Window bars in every voice, pins the rest (see Reharmonize), and
+ * searches the window exhaustively (PenaltyRatio 1) for anything better.
+ * Each round tries windows Window bars apart, one a job on Threads workers,
+ * starting a little further on each time; the windows that improved are
+ * then merged into the fit, best first, each kept only if ScoreSubmission
+ * says the whole is better (the rules look past a window's edges).  It
+ * stops after Seconds, or after a round at each starting point in turn
+ * finds nothing.  The penalty after each round that improved (and the
+ * first) goes in Penalties, with the seconds it took in Times, up to Most of
+ * them; returns how many.  Each improvement is left in BestFit and shown as
+ * the search's are.
+ */
+
+typedef struct {
+  int Lo, Hi;		/* the onsets freed */
+  double End;
+  Submission Fit;	/* the fit to improve, and its window's best */
+} ImproveWindow;
+
+Strategy ExactPlan = {1.0, 0, 0, 0, 0};
+
+int InWindow(ImproveWindow *w, int Time) {return((Time >= w->Lo) && (Time < w->Hi));}
+
+void WindowJob(int Job, void *Data)
 {
-  RhyPat[0][1]=WholeNote;
-  RhyNotes[0]=1;
-  RhyPat[1][0]=0; RhyPat[1][1]=HalfNote; RhyPat[1][2]=HalfNote;
-  RhyNotes[1]=2;
-  RhyPat[2][0]=0; RhyPat[2][1]=HalfNote; RhyPat[2][2]=QuarterNote; RhyPat[2][3]=QuarterNote; 
-  RhyNotes[2]=3;
-  RhyPat[3][0]=0; RhyPat[3][1]=QuarterNote; RhyPat[3][2]=QuarterNote; RhyPat[3][3]=QuarterNote; RhyPat[3][4]=QuarterNote; 
-  RhyNotes[3]=4;
-  RhyPat[4][0]=0; RhyPat[4][1]=QuarterNote; RhyPat[4][2]=QuarterNote; RhyPat[4][3]=HalfNote; 
-  RhyNotes[4]=3;
-  RhyPat[5][0]=0; RhyPat[5][1]=QuarterNote; RhyPat[5][2]=EighthNote; RhyPat[5][3]=EighthNote; RhyPat[5][4]=HalfNote;
-  RhyNotes[5]=4;
-  RhyPat[6][0]=0; RhyPat[6][1]=QuarterNote; RhyPat[6][2]=EighthNote; RhyPat[6][3]=EighthNote; RhyPat[6][4]=QuarterNote; RhyPat[6][5]=QuarterNote;
-  RhyNotes[6]=5;
-  RhyPat[7][0]=0; RhyPat[7][1]=HalfNote; RhyPat[7][2]=QuarterNote; RhyPat[7][3]=EighthNote; RhyPat[7][4]=EighthNote;
-  RhyNotes[7]=4;
-  RhyPat[8][0]=0; RhyPat[8][1]=QuarterNote; RhyPat[8][2]=EighthNote; RhyPat[8][3]=EighthNote; 
-  RhyPat[8][4]=QuarterNote; RhyPat[8][5]=EighthNote; RhyPat[8][6]=EighthNote; 
-  RhyNotes[8]=6;
-  RhyPat[9][0]=0; RhyPat[9][1]=QuarterNote; RhyPat[9][2]=QuarterNote; RhyPat[9][3]=QuarterNote; 
-  RhyPat[9][4]=EighthNote; RhyPat[9][5]=EighthNote; 
-  RhyNotes[9]=5;
-  RhyPat[10][1]=WholeNote;
-  RhyNotes[10]=1;
+  ImproveWindow *w = ((ImproveWindow *)Data)+Job;
+  Submission *s = &(w->Fit);
+  int i,v,Bound,UserPins[MostNotes][MostVoices];
+  Bound=ScoreSubmission(s);	/* also sets up this thread's state with the fit, raised notes lowered */
+  if (Bound < 0)
+    {
+      s->Penalty=infinity;
+      return;
+    }
+  for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) UserPins[i][v]=Pinned[i][v];
+  for (v=1;v<=s->Voices;v++)
+    for (i=2;i<=TotalNotes[v];i++) Pinned[i][v]=((InWindow(w,Onset[i][v])) ? 0 : Us(i,v)+BasePitch);
+  Plan=&ExactPlan;
+  PlanDeadline=w->End;
+  PlanPolls=0;
+  UseHistory=0;
+  Shuffling=0;
+  BestFitPenalty=Bound;
+  MaxPenalty=Bound;
+  PenaltyRatio=1.0;
+  AllDone=0;
+  Branches=0;
+  BestFitFirst(0,0,s->Voices,s->Species,0);
+  Plan=NULL;
+  AllDone=0;
+  if (BestFitPenalty < Bound)
+    {
+      for (v=1;v<=s->Voices;v++) for (i=1;i<=TotalNotes[v];i++) s->Pitches[v][i]=BestFit[i][v];
+      s->Penalty=BestFitPenalty;
+    }
+  for (i=0;i<MostNotes;i++) for (v=0;v<MostVoices;v++) Pinned[i][v]=UserPins[i][v];
 }
 
-static long randx = 1;
-#define inverse_rscl .000061035156
+/* the caller's fits, kept while the windows' searches use the thread's (without THREADS RunJobs runs them here) */
+typedef struct {int Best[3][MostNotes][MostVoices], Fits[3], Penalty, Show;} KeptFits;
 
-float RANDOM(float amp)
+void KeepFits(KeptFits *k)
 {
-  int i = ((randx = randx*1103515245 + 12345)>>16) & 077777;
-  return(amp * (((float)i)*inverse_rscl));
+  memcpy((void *)k->Best[0],(void *)BestFit,sizeof(BestFit));
+  memcpy((void *)k->Best[1],(void *)BestFit1,sizeof(BestFit1));
+  memcpy((void *)k->Best[2],(void *)BestFit2,sizeof(BestFit2));
+  memcpy((void *)k->Fits,(void *)Fits,sizeof(Fits));
+  k->Penalty=BestFitPenalty;
+  k->Show=ShowFits;
 }
 
-void UsedRhy(int n) {RhyPat[n][0]=RhyPat[n][0]+1;}
-int CurRhy(int n) {return(RhyPat[n][0]);}
-void CleanRhy() {int i; for (i=1;i<10;i++) RhyPat[i][0]=0;}
-int GoodRhy()
+void RestoreFits(KeptFits *k)
 {
-  int i;
-  i=(int)(RANDOM(10.0));
-  if (CurRhy(i) >  CurRhy(MAX(1,(i-1)))) return(MAX(1,(i-1)));
-  if (CurRhy(i) <= CurRhy(MIN(9,(i+1)))) return(MIN(9,(i+1)));
-  return(i);
+  memcpy((void *)BestFit,(void *)k->Best[0],sizeof(BestFit));
+  memcpy((void *)BestFit1,(void *)k->Best[1],sizeof(BestFit1));
+  memcpy((void *)BestFit2,(void *)k->Best[2],sizeof(BestFit2));
+  memcpy((void *)Fits,(void *)k->Fits,sizeof(Fits));
+  BestFitPenalty=k->Penalty;
+  ShowFits=k->Show;
 }
 
-void AnySpecies(int OurMode, int *StartPitches, int CurV, int CantusFirmusLength, int Species)
+int ImproveSolution(int Window, double Seconds, int *Penalties, double *Times, int Most)
 {
-  int i,j,k,m,v,OldSpecies,CurrentMode,BrLim;
-  for (i=0;i<MostNotes;i++)
-    for (j=1;j<MostVoices;j++)
-      {
-	BestFit[i][j]=0;
-	Ctrpt[i][j]=0;
-      }
-  PenaltyRatio=(1.0-(Species*CurV*.01));
-  BrLim=(50*(6-CurV)*(6-Species));
-  CurrentMode=OurMode;
-  Mode=OurMode;
-  TotalTime=((CantusFirmusLength-1)*8);
-  TotalNotes[0]=CantusFirmusLength;
-  BasePitch=((Ctrpt[CantusFirmusLength][0]) % 12);
-  BestFitPenalty=infinity;
-  MaxPenalty=infinity;
-  AllDone=0;
-  Branches=0;
-
-  for (i=1;i<=CantusFirmusLength;i++) 
+  ImproveWindow *Windows;
+  Submission *Fit,*Try;
+  KeptFits *Kept;
+  int i,j,k,v,b,Bars,Count,Step,Offset,Stale,Phases,Points,Current,Voices;
+  double Start;
+  if ((BestFitPenalty >= infinity) || (Window < 1)) return(0);
+  Start=Now();
+  Voices=SolveVoices;
+  Bars=(TotalNotes[0]-1);
+  Fit=(Submission *)calloc(2,sizeof(Submission));
+  Try=(Fit+1);
+  Fit->Mode=Mode; Fit->Species=SolveSpecies; Fit->Voices=Voices; Fit->Length=TotalNotes[0];
+  for (i=1;i<=TotalNotes[0];i++) Fit->Cantus[i-1]=(Ctrpt[i][0]+BasePitch);
+  for (v=1;v<=Voices;v++)
     {
-      Ctrpt[i][0] -= BasePitch;
-      Dur[i][0] = WholeNote;
-      Onset[i][0] = ((i-1)*8);
+      Fit->Notes[v]=TotalNotes[v];
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+	  Fit->Pitches[v][i]=BestFit[i][v];
+	  Fit->Durs[v][i]=Dur[i][v];
+	}
     }
-  OldSpecies=Species;
-  for (v=1;v<=CurV;v++)
+  Windows=(ImproveWindow *)malloc((2+(Bars/Window))*sizeof(ImproveWindow));
+  Kept=(KeptFits *)malloc(sizeof(KeptFits));
+  Current=ScoreSubmission(Fit);
+  Points=0;
+  if (Points < Most) {Penalties[Points]=Current; Times[Points]=0; Points++;}
+  Step=MAX(1,Window/2);
+  Phases=((2*Window)/Step);
+  Stale=0;
+  for (k=0;(Stale < Phases) && ((Now()-Start) < Seconds);k++)
     {
-      if (v != CurV) Species=1;
-      else Species = OldSpecies;
-      if (Species == 1)
+      Offset=((k % Phases)*Step);
+      Count=0;
+      for (b=(Offset-Window);b<Bars;b+=(2*Window))
 	{
-	  TotalNotes[v]=CantusFirmusLength;
-	  for (i=1;i<CantusFirmusLength;i++) Dur[i][v] = WholeNote;
+	  if (b+Window <= 0) continue;
+	  Windows[Count].Lo=(MAX(b,0)*WholeNote);
+	  Windows[Count].Hi=((b+Window)*WholeNote);
+	  if (b+Window >= Bars) Windows[Count].Hi=((Bars+1)*WholeNote);	/* and the final */
+	  Windows[Count].End=(Start+Seconds);
+	  Windows[Count].Fit=*Fit;
+	  Count++;
 	}
-      else
-	if (Species == 2)
-	  {
-	    TotalNotes[v]=(CantusFirmusLength*2)-1;
-	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = HalfNote;
-	  }
-      else
-	if (Species == 3)
-	  {
-	    TotalNotes[v]=(CantusFirmusLength*4)-3;
-	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = QuarterNote;
-	  }
-      else
-	if (Species == 4)
-	  {
-	    TotalNotes[v]=(CantusFirmusLength*2)-1;
-	    for (i=1;i<TotalNotes[v];i++) Dur[i][v] = HalfNote;
-	  }
-      else
+      KeepFits(Kept);
+      ShowFits=0;
+      RunJobs(Count,WindowJob,(void *)Windows);
+      RestoreFits(Kept);
+      Stale++;
+      while (1)			/* merge the windows that improved, best first */
 	{
-	  CleanRhy();
-	  m=0;
-	  for (i=1;i<CantusFirmusLength;i++)
+	  j=-1;
+	  for (i=0;i<Count;i++)
+	    if ((Windows[i].Fit.Penalty < Current) && ((j < 0) || (Windows[i].Fit.Penalty < Windows[j].Fit.Penalty))) j=i;
+	  if (j < 0) break;
+	  *Try=*Fit;
+	  for (v=1;v<=Voices;v++)
 	    {
-	      j=GoodRhy();
-	      UsedRhy(j);
-	      for (k=1;k<=(RhyNotes[j]);k++) Dur[k+m][v]=RhyPat[j][k];
-	      m += RhyNotes[j];
+	      for (i=1,b=0;i<=Try->Notes[v];b+=Try->Durs[v][i],i++)
+		if (InWindow(Windows+j,b)) Try->Pitches[v][i]=Windows[j].Fit.Pitches[v][i];
 	    }
-	  TotalNotes[v]=(m+1);
+	  if (ScoreSubmission(Try) < Current)
+	    {
+	      *Fit=*Try;
+	      Current=Try->Penalty;
+	      Stale=0;
+	    }
+	  Windows[j].Fit.Penalty=infinity;
+	}
+      if (Stale) continue;
+      if (Points < Most) {Penalties[Points]=Current; Times[Points]=(Now()-Start); Points++;}
+      BestFitPenalty=Current;
+      Fits[2]=Fits[1]; Fits[1]=Fits[0]; Fits[0]=Current;
+      for (v=1;v<=Voices;v++)
+	for (i=1;i<=TotalNotes[v];i++)
+	  {
+	    BestFit2[i][v]=BestFit1[i][v];
+	    BestFit1[i][v]=BestFit[i][v];
+	    BestFit[i][v]=Fit->Pitches[v][i];
+	  }
+      ShowBestFit(Voices);
+    }
+  ScoreSubmission(Fit);		/* leave the state as a solve would */
+  free(Kept);
+  free(Windows);
+  free(Fit);
+  return(Points);
+}
+
+
+/* CANTUS FIRMUS GENERATION
+ *
+ * The cantus is built in Ctrpt[..][0] one note at a time, using the same
+ * melodic rules (MelodyRules) the counterpoint gets.  It starts and ends on
+ * the final, approaches the final from the step above, stays in the mode
+ * and within a tenth, has at least as many steps as skips, and reaches its
+ * high point only once.  Every cantus whose penalty is at most CantusLimit
+ * is passed to the caller's handler.  The work is split by the first two
+ * melodic intervals, so each cantus is found exactly once.
+ */
+
+int CantusLimit = 12;
+int CantusSteps[15] = {1,-1,2,-2,3,-3,4,-4,5,-5,7,-7,8,12,-12};	/* Indx without repeated notes */
+
+typedef void (*CantusHandler)(int *Cantus, int Length, int Penalty, void *Data);
+
+typedef struct {int Mode, Final, Length, Limit, Found; CantusHandler Handler; void *Data;} CantusJob;
+#ifdef THREADS
+pthread_mutex_t CantusLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int CantusCheck(int Cn, int Cp, int Length)
+{
+  int Val,MelInt,LastMelInt,Int3,LastCp,LastCp2,LastCp3,Pitch,Final,i,Skips,Highest,Tops;
+  Final=Us(1,0);
+  LastCp=Us(Cn-1,0);
+  LastCp2=((Cn>2) ? Us(Cn-2,0) : 0);
+  LastCp3=((Cn>3) ? Us(Cn-3,0) : 0);
+  MelInt=(Cp-LastCp);
+  LastMelInt=((Cn>2) ? (LastCp-LastCp2) : 0);
+  Int3=((Cn>3) ? (LastCp2-LastCp3) : 0);
+  Pitch=(Cp % 12);
+  if ((MelInt == Unison) || (!(InMode(Pitch,Mode))) || (OutOfRange(Cp+BasePitch))) return(infinity);
+  if (TotalRange(Cn,Cp,0) > (Octave+MajorThird)) return(infinity);
+  if ((Cn == Length) && (Cp != Final)) return(infinity);
+  if ((Cn == (Length-1)) && ((Cp-Final) != ((Mode == Phrygian) ? MinorSecond : MajorSecond))) return(infinity);
+  if (ABS(Cp-Final) > ((Length-Cn)*Octave)) return(infinity);	/* cannot get home */
+
+  /* the counterpoint's melodic rules (bad intervals, skips, repeated notes and so on) */
+  Val=MelodyRules(Cn,MelInt,LastMelInt,Int3);
+  if (Val >= infinity) return(infinity);
+
+  /* and those of its other rules that a lone voice can break */
+  if ((Cn>2) && ((ABS(Cp-LastCp2)) == Tritone)) Val += MelodicTritonePenalty;
+  if ((Cn>3) && ((ABS(Cp-LastCp3)) == Tritone)) Val += MelodicTritonePenalty;
+  if ((Cn >= (Length-3)) && ((ABS(MelInt)) > 4)) Val += LeapAtCadencePenalty;
+  if ((Mode == Lydian) && ((Cn>(Length-4)) && (Pitch == 6))) Val += LydianCadentialTritonePenalty;
+  Val += (PitchRepeats(Cn,Cp,0)>>1);
+  if ((Cn>10) && (TooMuchOfInterval(Cn,Cp,0))) Val += MelodicBoredomPenalty;
+
+  /* the cantus' own */
+  if (TotalRange(Cn,Cp,0) > Octave) Val += CantusOverOctavePenalty;
+  if (Cn == Length)
+    {
+      Skips=0;
+      Highest=Cp;
+      for (i=2;i<Cn;i++)
+	{
+	  if (ASkip(Us(i,0)-Us(i-1,0))) Skips++;
+	  Highest=MAX(Highest,Us(i,0));
+	}
+      if ((Skips*2) > (Length-1)) Val += TooManySkipsPenalty;
+      Tops=0;
+      for (i=1;i<Cn;i++) if (Us(i,0) == Highest) Tops++;
+      if (Tops>1) Val += RepeatedClimaxPenalty;
+    }
+  return(Val);
+}
+
+int CantusDone(CantusJob *Job)
+{
+  int Done;
+#ifdef THREADS
+  pthread_mutex_lock(&CantusLock);
+#endif
+  Done=((Job->Limit > 0) && (Job->Found >= Job->Limit));
+#ifdef THREADS
+  pthread_mutex_unlock(&CantusLock);
+#endif
+  return(Done);
+}
+
+void FoundCantus(CantusJob *Job, int Penalty)
+{
+  int Cantus[MostNotes],i,Keep;
+#ifdef THREADS
+  pthread_mutex_lock(&CantusLock);
+#endif
+  Keep=((Job->Limit <= 0) || (Job->Found < Job->Limit));
+  if (Keep) Job->Found++;
+#ifdef THREADS
+  pthread_mutex_unlock(&CantusLock);
+#endif
+  if (!Keep) return;
+  for (i=1;i<=Job->Length;i++) Cantus[i-1]=(Us(i,0)+BasePitch);
+  (*(Job->Handler))(Cantus,Job->Length,Penalty,Job->Data);
+}
+
+void ExtendCantus(CantusJob *Job, int Cn, int Penalty)
+{
+  int i,Cp,p;
+  if (Cn > Job->Length)
+    {
+      FoundCantus(Job,Penalty);
+      return;
+    }
+  if (((Cn & 3) == 0) && (CantusDone(Job))) return;
+  for (i=0;i<15;i++)
+    {
+      Cp=(Us(Cn-1,0)+CantusSteps[i]);
+      p=CantusCheck(Cn,Cp,Job->Length);
+      if ((Penalty+p) <= CantusLimit)
+	{
+	  SetUs(Cn,Cp,0);
+	  ExtendCantus(Job,Cn+1,Penalty+p);
 	}
-      Dur[TotalNotes[v]][v]=WholeNote;
-      Onset[1][v]=0;
-      for (k=2;k<=TotalNotes[v];k++) Onset[k][v]=(Onset[k-1][v]+Dur[k-1][v]);
-      Ctrpt[1][v]=(StartPitches[v-1]-BasePitch);
     }
-  if (CurV == 1) MaxPenalty=(2*RealBad); else MaxPenalty=infinity;
-  BestFitFirst(0,0,CurV,Species,BrLim);
+}
+
+void CantusSubtree(int n, void *Data)
+{
+  CantusJob *Job = (CantusJob *)Data;
+  int p,Penalty,Cp,Cp1;
+  Mode=Job->Mode;
+  BasePitch=(Job->Final % 12);
+  SetUs(1,Job->Final-BasePitch,0);
+  Cp=(Us(1,0)+CantusSteps[n/15]);
+  Penalty=CantusCheck(2,Cp,Job->Length);
+  if (Penalty > CantusLimit) return;
+  SetUs(2,Cp,0);
+  Cp1=(Cp+CantusSteps[n%15]);
+  p=CantusCheck(3,Cp1,Job->Length);
+  if ((Penalty+p) > CantusLimit) return;
+  SetUs(3,Cp1,0);
+  ExtendCantus(Job,4,Penalty+p);
+}
+
+/* generate up to Limit (0 = all) cantus firmi of Length notes on Final (an absolute pitch) in OurMode */
+int GenerateCantus(int OurMode, int Final, int Length, int Limit, CantusHandler Handler, void *Data)
+{
+  CantusJob Job;
+  if ((Length < 4) || (Length >= MostNotes)) return(0);
+  Job.Mode=OurMode; Job.Final=Final; Job.Length=Length; Job.Limit=Limit; Job.Found=0;
+  Job.Handler=Handler; Job.Data=Data;
+  RunJobs(15*15,CantusSubtree,(void *)&Job);
+  return(Job.Found);
+}
+
+void PrintCantus(int *Cantus, int Length, int Penalty, void *Data)
+{
+  int i;
+  LockOutput();
+  printf("[%d]",Penalty);
+  for (i=0;i<Length;i++) printf(" %d",Cantus[i]);
+  printf("\n");
+  UnlockOutput();
+}
+
+double ImproveSeconds = 0;	/* if set, the command line polishes each solution with ImproveSolution for this long */
+int ImproveWindowBars = 2;
+int ChooseStartPitches = 0;	/* if set, the command line picks the start pitches with ChooseStarts */
+
+/* with -budget or -nodes, what the last search on this thread gave up for them (-portfolio has budgets of its own) */
+void ReportBudget()
+{
+  if (((PruneSeconds <= 0) && (PruneNodes <= 0)) || (PortfolioSeconds > 0)) return;
+  if (BestFitPenalty >= infinity) fprintf(stderr,"budget: nothing found");
+  else if (SearchFloor >= BestFitPenalty) fprintf(stderr,"budget: %d, the best",BestFitPenalty);
+  else fprintf(stderr,"budget: %d, at least %d (gap %.1f%%)",BestFitPenalty,SearchFloor,
+	       (100.0*(BestFitPenalty-SearchFloor))/((BestFitPenalty > 0) ? BestFitPenalty : 1));
+  fprintf(stderr," in %ld nodes, %.3f secs\n",SearchNodes-SearchFrom,SearchTime);
+}
+
+/* a CantusHandler that harmonizes each generated cantus (Data is a CantusSolve, and ShowFits should be off) */
+typedef struct {int Species, Voices, StartPitches[MostVoices];} CantusSolve;
+
+void SolveCantus(int *Cantus, int Length, int Penalty, void *Data)
+{
+  CantusSolve *Job = (CantusSolve *)Data;
+  int i,v,Saved[MostNotes],OldMode,OldBase,Starts[MostVoices];
+  OldMode=Mode; OldBase=BasePitch;
+  for (i=1;i<=Length;i++) Saved[i]=Ctrpt[i][0];
+  for (i=1;i<=Length;i++) Ctrpt[i][0]=Cantus[i-1];
+  for (v=0;v<Job->Voices;v++) Starts[v]=Job->StartPitches[v];
+  if (!((ChooseStartPitches) && (ChooseStarts(OldMode,Starts,Job->Voices,Length,Job->Species) >= 0)))
+    AnySpecies(OldMode,Starts,Job->Voices,Length,Job->Species);
+  LockOutput();
+  ReportBudget();
+  UnlockOutput();
+  if (ImproveSeconds > 0) ImproveSolution(ImproveWindowBars,ImproveSeconds,NULL,NULL,0);
+  LockOutput();
+  printf("[%d]",Penalty);
+  for (i=0;i<Length;i++) printf(" %d",Cantus[i]);
+  printf(" [%d]",BestFitPenalty);
+  for (v=1;v<=Job->Voices;v++)
+    {
+      printf(" |");
+      for (i=1;i<=TotalNotes[v];i++) printf(" %d",BestFit[i][v]);
+    }
+  printf("\n");
+  UnlockOutput();
+  Mode=OldMode; BasePitch=OldBase;
+  for (i=1;i<=Length;i++) Ctrpt[i][0]=Saved[i];
 }
 	
 void fillCantus(int c0, int c1, int c2, int c3, int c4, int c5, int c6, int c7, int c8, int c9, int c10, int c11, int c12, int c13, int c14)
@@ -1339,8 +4544,21 @@ void fillCantus(int c0, int c1, int c2, int c3, int c4, int c5, int c6, int c7,
   Ctrpt[14][0]=c13; Ctrpt[15][0]=c14;
 }
 
+char *ModeNames[8] = {"", "aeolian", "dorian", "phrygian", "lydian", "mixolydian", "ionian", "locrian"};
+
+int ModeNamed(char *name)
+{
+  int i,j;
+  for (i=1;i<8;i++)
+    {
+      for (j=0;(name[j]) && ((name[j] | 040) == ModeNames[i][j]);j++);
+      if ((name[j] == 0) && (ModeNames[i][j] == 0)) return(i);
+    }
+  return(atoi(name));
+}
+
 #ifdef CM
-int rhyfilled =0;
+Local int rhyfilled =0;
 
 void fux(int mode, int species, int voices, int cantuslen, int *voicebegs, int *cantus)
 {
@@ -1355,6 +4573,12 @@ void fux(int mode, int species, int voices, int cantuslen, int *voicebegs, int *
   AnySpecies(mode,voicebegs,voices,cantuslen,species);
 }
 
+/* after fux, change one cantus note and re-solve around it */
+int refux(int note, int pitch, int window)
+{
+  return(EditCantus(note,pitch,window));
+}
+
 void winners(int v1, int *data, int *best, int *best1, int *best2, int *durs)
 {
   int i,v,k;
@@ -1379,9 +4603,862 @@ void winners(int v1, int *data, int *best, int *best1, int *best2, int *durs)
 
 int vbs[MostVoices];
 
-main()
+int ReadPitch(void *Data)
+{
+  int p;
+  if (scanf("%d",&p) != 1) return(0);
+  return(p);
+}
+
+void PrintBars(int v, int Bar, int *Pitches, int *Durs, int Count, void *Data)
+{
+  int i;
+  printf("%d %d:",Bar,v);
+  for (i=0;i<Count;i++) printf(" %d/%d",Pitches[i],Durs[i]);
+  printf("\n");
+  fflush(stdout);
+}
+
+/* read "mode species cantus... | pitch/dur... | ..." (a voice after each bar, bass first), 0 at the end */
+int ReadSubmission(Submission *s)
+{
+  char Line[16384],*t;
+  int v,n,p,d;
+  while (fgets(Line,sizeof(Line),stdin))
+    {
+      t=strtok(Line," \t\n");
+      if (t == NULL) continue;
+      memset((void *)s,0,sizeof(Submission));
+      s->Mode=ModeNamed(t);
+      t=strtok(NULL," \t\n");
+      if (t) s->Species=atoi(t);
+      v=0; n=0;
+      while ((t=strtok(NULL," \t\n")) != NULL)
+	{
+	  if (t[0] == '|')
+	    {
+	      if (v >= (MostVoices-1)) break;
+	      s->Notes[v]=n;
+	      v++; n=0;
+	    }
+	  else
+	    {
+	      if (v == 0) {if (s->Length < (MostNotes-1)) s->Cantus[s->Length++]=atoi(t);}
+	      else if ((n < (MostNotes-1)) && (sscanf(t,"%d/%d",&p,&d) == 2)) {n++; s->Pitches[v][n]=p; s->Durs[v][n]=d;}
+	    }
+	}
+      s->Notes[v]=n;
+      s->Voices=v;
+      return(1);
+    }
+  return(0);
+}
+
+void PrintScore(Submission *s)
+{
+  int i,v;
+  printf("[%d]",s->Penalty);
+  for (i=0;i<NumberOfRules;i++) if (s->RulePenalty[i]) printf(" %s=%d",RuleNames[i],s->RulePenalty[i]);
+  for (v=1;v<=s->Voices;v++)
+    {
+      printf(" |");
+      for (i=1;i<=s->Notes[v];i++) printf(" %d",s->NotePenalty[v][i]);
+    }
+  printf("\n");
+}
+
+#define ScoreBatch 1024
+
+/* fux bench solves main's examples in each species, printing for each
+ * "mode voices species: [penalty] nodes ms" and, if the hardware counters
+ * can be read (Linux perf_event, this thread only), cycles, instructions,
+ * cache misses and branch misses per node expanded (see SearchNodes), then
+ * the totals.  Without counters it just times them.
+ */
+
+typedef struct {int Mode, Voices, Length, Starts[MostVoices], Cantus[15];} BenchJob;
+
+BenchJob BenchJobs[] = {
+  {Dorian, 1, 11, {57}, {50,53,52,50,55,53,57,55,53,52,50}},
+  {Dorian, 1, 11, {38}, {50,53,52,50,55,53,57,55,53,52,50}},
+  {Phrygian, 1, 10, {59}, {52,48,50,48,45,57,55,52,53,52}},
+  {Phrygian, 1, 10, {40}, {52,48,50,48,45,57,55,52,53,52}},
+  {Lydian, 1, 12, {65}, {53,55,57,53,50,52,53,60,57,53,55,53}},
+  {Lydian, 1, 12, {41}, {53,55,57,53,50,52,53,60,57,53,55,53}},
+  {Mixolydian, 1, 14, {55}, {43,48,47,43,48,52,50,55,52,48,50,47,45,43}},
+  {Mixolydian, 1, 14, {43}, {43,48,47,43,48,52,50,55,52,48,50,47,45,43}},
+  {Aeolian, 1, 12, {57}, {45,48,47,50,48,52,53,52,50,48,47,45}},
+  {Aeolian, 1, 12, {45}, {45,48,47,50,48,52,53,52,50,48,47,45}},
+  {Dorian, 2, 11, {57,62}, {50,53,52,50,55,53,57,55,53,52,50}}};
+
+#define MostSnaps 4096			/* for fux snap */
+#define NumCounters 4
+char *CounterNames[NumCounters] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+int CounterFds[NumCounters] = {-1, -1, -1, -1};
+
+/* returns 1 if all the counters could be opened (as one group, so they count the same stretch) */
+int OpenCounters()
+{
+#ifdef __linux__
+  unsigned long long Config[NumCounters] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  struct perf_event_attr a;
+  int i;
+  for (i=0;i<NumCounters;i++)
+    {
+      memset((void *)&a,0,sizeof(a));
+      a.type=PERF_TYPE_HARDWARE;
+      a.size=sizeof(a);
+      a.config=Config[i];
+      a.disabled=(i == 0);
+      a.exclude_kernel=1;
+      a.exclude_hv=1;
+      a.read_format=PERF_FORMAT_GROUP;
+      CounterFds[i]=syscall(__NR_perf_event_open,&a,0,-1,((i == 0) ? -1 : CounterFds[0]),0);
+      if (CounterFds[i] < 0)
+	{
+	  perror("fux bench: perf_event_open");
+	  while (i > 0) close(CounterFds[--i]);
+	  CounterFds[0]=-1;
+	  return(0);
+	}
+    }
+  ioctl(CounterFds[0],PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+  return(1);
+#else
+  return(0);
+#endif
+}
+
+void ReadCounters(unsigned long long *Values)
+{
+  unsigned long long Group[1+NumCounters];
+  int i;
+  if ((CounterFds[0] < 0) || (read(CounterFds[0],(void *)Group,sizeof(Group)) != sizeof(Group)))
+    for (i=0;i<NumCounters;i++) Values[i]=0;
+  else for (i=0;i<NumCounters;i++) Values[i]=Group[1+i];
+}
+
+void PrintCounters(unsigned long long *Counts, long Nodes)
+{
+  int i;
+  if (CounterFds[0] < 0) return;
+  Nodes=MAX(Nodes,1);
+  for (i=0;i<NumCounters;i++) printf(" %.1f %s",(double)Counts[i]/Nodes,CounterNames[i]);
+  printf(" %.2f IPC",((Counts[0]) ? ((double)Counts[1]/Counts[0]) : 0.0));
+}
+
+void Bench(int Report)
+{
+  BenchJob *b;
+  unsigned long long Before[NumCounters],After[NumCounters],Counts[NumCounters],Total[NumCounters];
+  long Nodes,AllNodes;
+  double Start,Time,AllTime;
+  int i,j,Species,Counters,Quota;
+  Quota=(MostSnaps/(5*(sizeof(BenchJobs)/sizeof(BenchJob))));
+  Counters=((Report) && (OpenCounters()));
+  if ((Report) && (!(Counters))) fprintf(stderr,"fux bench: no hardware counters, timing only\n");
+  ShowFits=0;
+  AllNodes=0;
+  AllTime=0;
+  for (i=0;i<NumCounters;i++) Total[i]=0;
+  for (Species=1;Species<=5;Species++)
+    for (j=0;j<(sizeof(BenchJobs)/sizeof(BenchJob));j++)
+      {
+	b=(BenchJobs+j);
+	for (i=1;i<=b->Length;i++) Ctrpt[i][0]=b->Cantus[i-1];
+	for (i=0;i<3;i++) Fits[i]=0;
+	if (Snapping) SnapLimit=(SnapCount+Quota);
+	Nodes=SearchNodes;
+	ReadCounters(Before);
+	Start=Now();
+	AnySpecies(b->Mode,b->Starts,b->Voices,b->Length,Species);
+	Time=(Now()-Start);
+	ReadCounters(After);
+	Nodes=(SearchNodes-Nodes);
+	for (i=0;i<NumCounters;i++)
+	  {
+	    Counts[i]=(After[i]-Before[i]);
+	    Total[i] += Counts[i];
+	  }
+	AllNodes += Nodes;
+	AllTime += Time;
+	if (!(Report)) continue;
+	printf("%s %d %d: [%d] %ld nodes %.1f ms",ModeNames[b->Mode],b->Voices,Species,BestFitPenalty,Nodes,Time*1000);
+	PrintCounters(Counts,Nodes);
+	printf("\n");
+      }
+  if (!(Report)) return;
+  printf("total: %ld nodes %.1f ms %.2f us/node",AllNodes,AllTime*1000,(AllTime*1000000)/MAX(AllNodes,1));
+  PrintCounters(Total,AllNodes);
+  printf("\n");
+}
+
+/* fux snap saves MostSnaps snapshots (see SnapCheck), an even share from
+ * each of Bench's solves, to a file that fux micro replays: each state is
+ * set up once and then Check (through VoiceCheck, as Look calls it),
+ * OtherVoiceCheck and SpecialSpeciesCheck are run Reps times over it.  It
+ * prints the nanoseconds per candidate for each, by species, and counts
+ * any penalty that differs from the one saved with the state (see Differs).
+ */
+
+typedef struct {char Magic[8]; unsigned int Version,PenaltyHash,Count,RecordSize;} SnapHeader;
+
+int SaveSnapshots(char *Name)
+{
+  SnapHeader h;
+  FILE *f;
+  Snaps=(Snapshot *)malloc(MostSnaps*sizeof(Snapshot));
+  SnapCount=0;
+  Snapping=1;
+  Bench(0);
+  Snapping=0;
+  memcpy(h.Magic,"FUXSNAPS",8);
+  h.Version=1; h.PenaltyHash=PenaltyHash(); h.Count=SnapCount; h.RecordSize=sizeof(Snapshot);
+  f=fopen(Name,"wb");
+  if ((f == NULL) || (fwrite((void *)&h,sizeof(h),1,f) != 1) || (fwrite((void *)Snaps,sizeof(Snapshot),SnapCount,f) != SnapCount))
+    {
+      fprintf(stderr,"can't write %s\n",Name);
+      if (f) fclose(f);
+      free(Snaps);
+      return(0);
+    }
+  fclose(f);
+  fprintf(stderr,"%d snapshots in %s\n",SnapCount,Name);
+  free(Snaps);
+  return(1);
+}
+
+volatile int Sink;
+
+int Micro(char *Name, int Reps)
+{
+  SnapHeader h;
+  Snapshot *s;
+  FILE *f;
+  int i,j,r,n,Species,Differ,Count[6];
+  double Start,Time[6][3];
+  f=fopen(Name,"rb");
+  if ((f == NULL) || (fread((void *)&h,sizeof(h),1,f) != 1) || (memcmp(h.Magic,"FUXSNAPS",8) != 0) || (h.RecordSize != sizeof(Snapshot)))
+    {
+      fprintf(stderr,"%s is not a snapshot file from this fux\n",Name);
+      if (f) fclose(f);
+      return(0);
+    }
+  if (h.PenaltyHash != PenaltyHash()) fprintf(stderr,"%s was made with other penalties, so they will differ\n",Name);
+  Snaps=(Snapshot *)malloc(h.Count*sizeof(Snapshot));
+  n=fread((void *)Snaps,sizeof(Snapshot),h.Count,f);
+  fclose(f);
+  for (i=0;i<6;i++) {Count[i]=0; for (j=0;j<3;j++) Time[i][j]=0;}
+  Differ=0;
+  for (i=0;i<n;i++)
+    {
+      s=(Snaps+i);
+      LoadSnapshot(s);
+      Species=((s->v == s->NumParts) ? s->Species : 1);
+      if (Differs(VoiceCheck[s->v](s->Cn,s->Cp,s->v,s->CurLim),s->Penalty,s->CurLim)) Differ++;
+      if (Differs(OtherCheck(s->Cn,s->Cp,s->v,s->NumParts,Species,s->CurLim),s->OtherPenalty,s->CurLim)) Differ++;
+      if (Differs(SpecialCheck(s->Cn,s->Cp,s->v,s->NumParts,Species,s->CurLim),s->SpecialPenalty,s->CurLim)) Differ++;
+      Start=Now();
+      for (r=0;r<Reps;r++) Sink=VoiceCheck[s->v](s->Cn,s->Cp,s->v,s->CurLim);
+      Time[s->Species][0] += (Now()-Start);
+      Start=Now();
+      for (r=0;r<Reps;r++) Sink=OtherCheck(s->Cn,s->Cp,s->v,s->NumParts,Species,s->CurLim);
+      Time[s->Species][1] += (Now()-Start);
+      Start=Now();
+      for (r=0;r<Reps;r++) Sink=SpecialCheck(s->Cn,s->Cp,s->v,s->NumParts,Species,s->CurLim);
+      Time[s->Species][2] += (Now()-Start);
+      Count[s->Species]++;
+    }
+  for (i=1;i<6;i++)
+    {
+      Count[0] += Count[i];
+      for (j=0;j<3;j++) Time[0][j] += Time[i][j];
+      if (Count[i] == 0) continue;
+      printf("species %d: %d states, Check %.1f OtherVoiceCheck %.1f SpecialSpeciesCheck %.1f ns\n",i,Count[i],
+	     (Time[i][0]*1e9)/((double)Count[i]*Reps),(Time[i][1]*1e9)/((double)Count[i]*Reps),(Time[i][2]*1e9)/((double)Count[i]*Reps));
+    }
+  printf("all: %d states, Check %.1f OtherVoiceCheck %.1f SpecialSpeciesCheck %.1f ns, %d penalties differ\n",Count[0],
+	 (Time[0][0]*1e9)/(MAX(Count[0],1)*(double)Reps),(Time[0][1]*1e9)/(MAX(Count[0],1)*(double)Reps),
+	 (Time[0][2]*1e9)/(MAX(Count[0],1)*(double)Reps),Differ);
+  free(Snaps);
+  return(1);
+}
+
+/* fux trace file prints, for each search in a trace (see StartTrace), each
+ * new best fit with the seconds and onsets it took to find, then for each
+ * depth (onsets from the start) how many onsets were entered, how many
+ * continuations Look ranked and how many were tried per onset (the branching
+ * factor), and how often BrLim tightened MaxPenalty there.
+ */
+
+#define TraceDepths 1024
+
+int SummariseTrace(char *Name)
+{
+  TraceHeader *h;
+  TraceEvent *e;
+  struct stat st;
+  long i,n,Nodes,*Entered,*Ranked,*Tried,*Cut;
+  int fd,d,k,Deepest,Searches;
+  fd=open(Name,O_RDONLY);
+  if (fd < 0) {perror(Name); return(0);}
+  h=MAP_FAILED;
+  if ((fstat(fd,&st) == 0) && (st.st_size >= (off_t)sizeof(TraceHeader)))
+    h=(TraceHeader *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if ((h == MAP_FAILED) || (memcmp(h->Magic,"FUXTRACE",8) != 0) || (h->EventSize != sizeof(TraceEvent)))
+    {
+      fprintf(stderr,"%s is not a trace from this fux\n",Name);
+      if (h != MAP_FAILED) munmap((void *)h,st.st_size);
+      return(0);
+    }
+  n=((st.st_size-sizeof(TraceHeader))/sizeof(TraceEvent));
+  Entered=(long *)calloc(4*TraceDepths,sizeof(long));
+  Ranked=(Entered+TraceDepths); Tried=(Ranked+TraceDepths); Cut=(Tried+TraceDepths);
+  d=0; Deepest=0; Nodes=0; Searches=0;
+  for (i=0,e=(TraceEvent *)(h+1);i<n;i++,e++)
+    {
+      k=MIN(d,TraceDepths-1);
+      switch (e->Kind)
+	{
+	case TraceEnter:
+	  if (d == 0) printf("search %d:\n",++Searches);
+	  Nodes++;
+	  d++;
+	  k=MIN(d,TraceDepths-1);
+	  Entered[k]++;
+	  Deepest=MAX(Deepest,k);
+	  break;
+	case TraceLook: Ranked[k] += e->Arg; break;
+	case TraceLeave: Tried[k] += e->Arg; d=MAX(d-1,0); break;
+	case TracePrune: Cut[k]++; break;
+	case TraceBest: printf("  [%d] at %.3f s after %ld onsets\n",e->Penalty,e->Micros/1000000.0,Nodes); break;
+	}
+    }
+  printf("depth   onsets  ranked   tried  cuts\n");
+  for (k=1;k<=Deepest;k++)
+    if (Entered[k]) printf("%5d %8ld %7.2f %7.2f %5ld\n",k,Entered[k],(double)Ranked[k]/Entered[k],(double)Tried[k]/Entered[k],Cut[k]);
+  printf("%ld events, %ld onsets\n",n,Nodes);
+  free(Entered);
+  munmap((void *)h,st.st_size);
+  return(1);
+}
+
+/* JOB CORPORA
+ *
+ * A corpus is a file of fixed-size CorpusJob records behind a CorpusHeader,
+ * written by fux corpus from text lines "mode species cantus... | start...".
+ * fux solve maps it and solves every job in place (on Threads threads, with
+ * the same options as the command line's cantus jobs), writing each result
+ * into the record of the same index in a results file, also mapped.  Since
+ * each job has its own record the workers need no locks, and a results file
+ * made from the same corpus under the same penalties is taken up where it
+ * was left: jobs already done are skipped.  fux results prints a results
+ * file as "job [penalty] | pitch/dur... | ...", the same as score's input.
+ */
+
+#define CorpusVersion 1
+
+typedef struct {
+  unsigned char Mode,Species,Voices,Length;
+  unsigned char Starts[MostVoices],Cantus[MostNotes];	/* absolute pitches */
+} CorpusJob;
+
+enum {JobPending, JobSolved, JobRejected};
+
+typedef struct {
+  int Penalty;			/* -1 = nothing found */
+  unsigned char State,Voices;
+  unsigned char TotalNotes[MostVoices];
+  unsigned char Notes[MostVoices][MostNotes],Dur[MostVoices][MostNotes];	/* [v][i] as in BestFit and Dur */
+} JobResult;
+
+typedef struct {char Magic[8]; unsigned int Version,PenaltyHash,Count,RecordSize; char Pad[40];} CorpusHeader;
+
+typedef struct {CorpusJob *Jobs; JobResult *Results;} Corpus;
+
+/* map Name, and if Size is not 0 make it that big first (a fresh file); returns NULL if it can't */
+CorpusHeader *MapCorpusFile(char *Name, size_t *Size, int Writable)
+{
+  int fd;
+  struct stat st;
+  CorpusHeader *h;
+  fd=open(Name,(Writable ? (O_RDWR | O_CREAT) : O_RDONLY),0644);
+  if (fd < 0) return(NULL);
+  if ((*Size) && ((ftruncate(fd,0) < 0) || (ftruncate(fd,*Size) < 0))) {close(fd); return(NULL);}
+  if ((fstat(fd,&st) < 0) || (st.st_size < (off_t)sizeof(CorpusHeader))) {close(fd); return(NULL);}
+  *Size=st.st_size;
+  h=(CorpusHeader *)mmap(NULL,*Size,(Writable ? (PROT_READ | PROT_WRITE) : PROT_READ),MAP_SHARED,fd,0);
+  close(fd);
+  return((h == MAP_FAILED) ? NULL : h);
+}
+
+int CorpusFileOk(CorpusHeader *h, size_t Size, char *Magic, unsigned int RecordSize)
+{
+  return((memcmp(h->Magic,Magic,8) == 0) && (h->Version == CorpusVersion) && (h->RecordSize == RecordSize) &&
+	 (Size >= (sizeof(CorpusHeader)+((size_t)(h->Count)*RecordSize))));
+}
+
+/* can AnySpecies take this job (room for the counterpoint's notes, as in fuxmodule's solve) */
+int GoodJob(CorpusJob *j)
+{
+  return((j->Mode >= Aeolian) && (j->Mode <= Locrian) && (j->Species >= 1) && (j->Species <= 5) &&
+	 (j->Voices >= 1) && (j->Voices < MostVoices) && (j->Length >= 3) &&
+	 ((j->Length*((j->Species == 5) ? 6 : ((j->Species == 3) ? 4 : 2))) < MostNotes));
+}
+
+int WriteCorpus(char *Name)
+{
+  char Line[16384],*t;
+  CorpusJob *Jobs,*j;
+  CorpusHeader *h;
+  size_t Size;
+  int Count,Room,Bar,Lines;
+  Room=1024; Count=0; Lines=0;
+  Jobs=(CorpusJob *)malloc(Room*sizeof(CorpusJob));
+  while (fgets(Line,sizeof(Line),stdin))
+    {
+      Lines++;
+      t=strtok(Line," \t\n");
+      if (t == NULL) continue;
+      if (Count == Room) Jobs=(CorpusJob *)realloc((void *)Jobs,(Room*=2)*sizeof(CorpusJob));
+      j=(Jobs+Count);
+      memset((void *)j,0,sizeof(CorpusJob));
+      j->Mode=ModeNamed(t);
+      t=strtok(NULL," \t\n");
+      if (t) j->Species=atoi(t);
+      Bar=0;
+      while ((t=strtok(NULL," \t\n")) != NULL)
+	{
+	  if (t[0] == '|') Bar=1;
+	  else if (!(Bar)) {if (j->Length < (MostNotes-1)) j->Cantus[j->Length++]=atoi(t);}
+	  else if (j->Voices < (MostVoices-1)) j->Starts[j->Voices++]=atoi(t);
+	}
+      if (GoodJob(j)) Count++;
+      else fprintf(stderr,"fux corpus: can't solve line %d\n",Lines);
+    }
+  Size=(sizeof(CorpusHeader)+(Count*sizeof(CorpusJob)));
+  h=MapCorpusFile(Name,&Size,1);
+  if (h == NULL)
+    {
+      perror(Name);
+      free(Jobs);
+      return(0);
+    }
+  memcpy(h->Magic,"FUXJOBS ",8);
+  h->Version=CorpusVersion; h->PenaltyHash=0; h->Count=Count; h->RecordSize=sizeof(CorpusJob);
+  memcpy((void *)(h+1),(void *)Jobs,Count*sizeof(CorpusJob));
+  munmap((void *)h,Size);
+  free(Jobs);
+  fprintf(stderr,"%d jobs in %s\n",Count,Name);
+  return(1);
+}
+
+void CorpusSolve(int Job, void *Data)
+{
+  Corpus *c = (Corpus *)Data;
+  CorpusJob *j;
+  JobResult *r;
+  int i,v,Starts[MostVoices];
+  j=(c->Jobs+Job);
+  r=(c->Results+Job);
+  if (r->State != JobPending) return;
+  if (!(GoodJob(j)))
+    {
+      r->Penalty=-1;
+      r->State=JobRejected;
+      return;
+    }
+  for (i=1;i<=j->Length;i++) Ctrpt[i][0]=j->Cantus[i-1];
+  for (v=0;v<j->Voices;v++) Starts[v]=j->Starts[v];
+  for (i=0;i<3;i++) Fits[i]=0;
+  if (!((ChooseStartPitches) && (ChooseStarts(j->Mode,Starts,j->Voices,j->Length,j->Species) >= 0)))
+    AnySpecies(j->Mode,Starts,j->Voices,j->Length,j->Species);
+  if (ImproveSeconds > 0) ImproveSolution(ImproveWindowBars,ImproveSeconds,NULL,NULL,0);
+  r->Penalty=((BestFitPenalty < infinity) ? BestFitPenalty : -1);
+  r->Voices=j->Voices;
+  for (v=1;v<=j->Voices;v++)
+    {
+      r->TotalNotes[v]=TotalNotes[v];
+      for (i=1;i<=TotalNotes[v];i++)
+	{
+	  r->Notes[v][i]=BestFit[i][v];
+	  r->Dur[v][i]=Dur[i][v];
+	}
+    }
+  r->State=JobSolved;		/* last, so a run cut short leaves the job pending */
+}
+
+int SolveCorpus(char *JobsName, char *ResultsName)
+{
+  CorpusHeader *h,*rh;
+  size_t Size,ResultsSize;
+  Corpus c;
+  int Fresh,Done,i;
+  Size=0;
+  h=MapCorpusFile(JobsName,&Size,0);
+  if ((h == NULL) || (!(CorpusFileOk(h,Size,"FUXJOBS ",sizeof(CorpusJob)))))
+    {
+      fprintf(stderr,"%s is not a corpus from this fux\n",JobsName);
+      if (h) munmap((void *)h,Size);
+      return(0);
+    }
+  ResultsSize=0;
+  rh=MapCorpusFile(ResultsName,&ResultsSize,1);
+  Fresh=((rh == NULL) || (!(CorpusFileOk(rh,ResultsSize,"FUXRSLTS",sizeof(JobResult)))) ||
+	 (rh->Count != h->Count) || (rh->PenaltyHash != PenaltyHash()));
+  if (Fresh)
+    {
+      if (rh) munmap((void *)rh,ResultsSize);
+      ResultsSize=(sizeof(CorpusHeader)+((size_t)(h->Count)*sizeof(JobResult)));
+      rh=MapCorpusFile(ResultsName,&ResultsSize,1);
+      if (rh == NULL)
+	{
+	  perror(ResultsName);
+	  munmap((void *)h,Size);
+	  return(0);
+	}
+      memcpy(rh->Magic,"FUXRSLTS",8);
+      rh->Version=CorpusVersion; rh->PenaltyHash=PenaltyHash(); rh->Count=h->Count; rh->RecordSize=sizeof(JobResult);
+    }
+  c.Jobs=(CorpusJob *)(h+1);
+  c.Results=(JobResult *)(rh+1);
+  for (Done=0,i=0;i<h->Count;i++) if (c.Results[i].State != JobPending) Done++;
+  if (Done) fprintf(stderr,"%d of %d jobs already done\n",Done,h->Count);
+  ShowFits=0;
+  RunJobs(h->Count,CorpusSolve,(void *)&c);
+  munmap((void *)rh,ResultsSize);
+  munmap((void *)h,Size);
+  return(1);
+}
+
+int PrintResults(char *Name)
+{
+  CorpusHeader *h;
+  JobResult *r;
+  size_t Size;
+  int i,v,k;
+  Size=0;
+  h=MapCorpusFile(Name,&Size,0);
+  if ((h == NULL) || (!(CorpusFileOk(h,Size,"FUXRSLTS",sizeof(JobResult)))))
+    {
+      fprintf(stderr,"%s is not a results file from this fux\n",Name);
+      if (h) munmap((void *)h,Size);
+      return(0);
+    }
+  for (k=0,r=(JobResult *)(h+1);k<h->Count;k++,r++)
+    {
+      if (r->State == JobPending) continue;
+      printf("%d [%d]",k,r->Penalty);
+      if (r->Penalty >= 0)
+	for (v=1;v<=r->Voices;v++)
+	  {
+	    printf(" |");
+	    for (i=1;i<=r->TotalNotes[v];i++) printf(" %d/%d",r->Notes[v][i],r->Dur[v][i]);
+	  }
+      printf("\n");
+    }
+  munmap((void *)h,Size);
+  return(1);
+}
+
+/* DIFFERENTIAL TESTS
+ *
+ * fux diff solves Count random jobs (see RandomJob) twice, with the search as
+ * it is (checking every candidate against the reference's penalty on the
+ * way, see DiffCheck) and with the reference engine (see UseReference), from
+ * the same random state.  Any job where a candidate's penalty or the best
+ * fit differ is minimised (see MinimiseJob) and printed as a corpus line,
+ * so fux corpus can keep it.  A cache, a portfolio or a budget would let
+ * the two runs find different fits for reasons of their own, so Differential
+ * turns -cache, -portfolio, -budget, -nodes and -starts off while it runs.
+ */
+
+long DiffRandom(long *Seed) {*Seed=((*Seed)*1103515245)+12345; return(((*Seed) >> 16) & 0x7fff);}
+
+void RandomJob(CorpusJob *j, long *Seed)
+{
+  int i,p,Final,n,Step,Sets[MostStarts][MostVoices];
+  memset((void *)j,0,sizeof(CorpusJob));
+  j->Mode=(Aeolian+(DiffRandom(Seed) % 7));
+  j->Species=(1+(DiffRandom(Seed) % 5));
+  j->Voices=(1+(DiffRandom(Seed) % ((j->Species <= 2) ? 3 : 2)));
+  j->Length=(6+(DiffRandom(Seed) % 6));
+  Final=(45+(DiffRandom(Seed) % 12));
+  j->Cantus[0]=Final;
+  p=Final;
+  for (i=1;i<(j->Length-2);i++)
+    {
+      do
+	{
+	  Step=(1+(DiffRandom(Seed) % 4));
+	  if (DiffRandom(Seed) & 1) Step=(-Step);
+	}
+      while ((!(InMode(p+Step-Final,j->Mode))) || ((p+Step) < (Final-Fifth)) || ((p+Step) > (Final+Octave)));
+      p += Step;
+      j->Cantus[i]=p;
+    }
+  j->Cantus[j->Length-2]=(Final+MajorSecond);
+  j->Cantus[j->Length-1]=Final;
+  for (i=1;i<=j->Length;i++) Ctrpt[i][0]=j->Cantus[i-1];
+  n=StartSets(j->Mode,j->Voices,j->Length,Sets);
+  for (i=0;i<j->Voices;i++) j->Starts[i]=((n > 0) ? Sets[DiffRandom(Seed) % MIN(n,3)][i] : (Final+(i*Octave)));
+}
+
+void PrintJob(CorpusJob *j)
+{
+  int i;
+  printf("%s %d",ModeNames[j->Mode],j->Species);
+  for (i=0;i<j->Length;i++) printf(" %d",j->Cantus[i]);
+  printf(" |");
+  for (i=0;i<j->Voices;i++) printf(" %d",j->Starts[i]);
+  printf("\n");
+}
+
+/* returns 1 if the engines differ on j (solved from the random state Seed) */
+int DiffJob(CorpusJob *j, long Seed)
+{
+  int i,v,Starts[MostVoices],Penalty,Fit[MostNotes][MostVoices];
+  for (v=0;v<j->Voices;v++) Starts[v]=j->Starts[v];
+  DiffCandidates=0;
+  Differing=1;
+  for (i=1;i<=j->Length;i++) Ctrpt[i][0]=j->Cantus[i-1];
+  randx=Seed;
+  AnySpecies(j->Mode,Starts,j->Voices,j->Length,j->Species);
+  Differing=0;
+  Penalty=BestFitPenalty;
+  memcpy((void *)Fit,(void *)BestFit,sizeof(Fit));
+  UseReference(1);
+  for (i=1;i<=j->Length;i++) Ctrpt[i][0]=j->Cantus[i-1];
+  randx=Seed;
+  AnySpecies(j->Mode,Starts,j->Voices,j->Length,j->Species);
+  UseReference(0);
+  return((DiffCandidates > 0) || (Penalty != BestFitPenalty) || (memcmp((void *)Fit,(void *)BestFit,sizeof(Fit)) != 0));
+}
+
+/* drop voices and cantus notes from a failing job while it still fails */
+void MinimiseJob(CorpusJob *j, long Seed)
+{
+  CorpusJob Try;
+  int i,Smaller;
+  do
+    {
+      Smaller=0;
+      if (j->Voices > 1)
+	{
+	  Try=(*j);
+	  Try.Voices--;
+	  if (DiffJob(&Try,Seed)) {*j=Try; Smaller=1;}
+	}
+      for (i=1;(i < (j->Length-1)) && (j->Length > 4);i++)
+	{
+	  Try=(*j);
+	  memmove((void *)(Try.Cantus+i),(void *)(Try.Cantus+i+1),Try.Length-i-1);
+	  Try.Length--;
+	  if (DiffJob(&Try,Seed)) {*j=Try; Smaller=1; i--;}
+	}
+    }
+  while (Smaller);
+}
+
+int Differential(int Count, long Seed)
+{
+  CorpusJob j;
+  int k,Failed,Starts;
+  long Checks,Nodes;
+  double Portfolio,Budget;
+  CacheHeader *Cache;
+  if ((CacheFile) || (PortfolioSeconds > 0) || (PruneSeconds > 0) || (PruneNodes > 0) || (ChooseStartPitches))
+    fprintf(stderr,"fux diff ignores -cache, -portfolio, -budget, -nodes and -starts\n");
+  Cache=CacheFile; CacheFile=NULL;
+  Portfolio=PortfolioSeconds; PortfolioSeconds=0;
+  Budget=PruneSeconds; PruneSeconds=0;
+  Nodes=PruneNodes; PruneNodes=0;
+  Starts=ChooseStartPitches; ChooseStartPitches=0;
+  ShowFits=0;
+  Failed=0;
+  Checks=0;
+  for (k=0;k<Count;k++)
+    {
+      RandomJob(&j,&Seed);
+      DiffChecks=0;
+      if (!(DiffJob(&j,k+1)))
+	{
+	  Checks += DiffChecks;
+	  continue;
+	}
+      Checks += DiffChecks;
+      Failed++;
+      printf("job %d differs",k);
+      if (DiffCandidates) printf(" (%ld candidates, first at note %d of voice %d, pitch %d: %d, reference %d)",
+				 DiffCandidates,DiffAt[0],DiffAt[2],DiffAt[1],DiffAt[3],DiffAt[4]);
+      printf(":\n  ");
+      PrintJob(&j);
+      MinimiseJob(&j,k+1);
+      printf("  minimised: ");
+      PrintJob(&j);
+    }
+  printf("%d jobs, %ld candidates compared, %d differ\n",Count,Checks,Failed);
+  CacheFile=Cache; PortfolioSeconds=Portfolio; PruneSeconds=Budget; PruneNodes=Nodes; ChooseStartPitches=Starts;
+  return(Failed == 0);
+}
+
+/* fux [-cache file] [-discrepancy budget] [-portfolio seconds] [-budget seconds] [-nodes count] [-improve seconds] [-starts] [-trace file] cantus mode final length [count [species voices start-pitch...]]
+ *   prints generated cantus firmi, harmonizing each one if a species is given
+ * fux stream mode final species window commit voices start-pitch... < cantus
+ *   harmonizes a cantus of any length, printing "bar voice: pitch/dur..." as bars are committed
+ * fux score < submissions
+ *   scores each line (see ReadSubmission), printing "[total] rule=penalty... | note penalties..."
+ * fux bench
+ *   solves main's examples in each species, timing them and reading the hardware counters if it can (see Bench)
+ * fux snap file
+ * fux micro file [reps]
+ *   saves states the checks saw in bench's solves, and times the checks on them (see Micro)
+ * fux trace file
+ *   summarises a trace written with -trace (see SummariseTrace)
+ * fux corpus jobs < lines
+ * fux solve jobs results
+ * fux results results
+ *   writes a job corpus from "mode species cantus... | start..." lines, solves it into a results file, and prints that
+ * fux diff [count [seed]]
+ *   compares the search with the reference engine on count random jobs (see Differential)
+ *   -cache keeps solutions in (and takes them from) file
+ *   -discrepancy searches only paths with at most budget discrepancies (see DiscrepancySearch), a quick preview
+ *   -portfolio races DefaultPlans against each other (see PortfolioSpecies) for at most seconds a job
+ *   -budget and -nodes tighten each search to fit about that long or that many nodes (see Tighten), reporting the gap given up
+ *   -improve re-solves two bar windows of each solution (see ImproveSolution) for at most seconds
+ *   -starts tries the likely start pitches (see ChooseStarts) instead of those given
+ *   -trace records the main thread's searches in file (see StartTrace)
+ */
+int Batch(int argc, char **argv)
+{
+  CantusSolve Solve;
+  Submission *Scores;
+  int i,Count;
+  if (strcmp(argv[1],"bench") == 0)
+    {
+      Bench(1);
+      return(1);
+    }
+  if ((argc > 2) && (strcmp(argv[1],"snap") == 0))
+    {
+      SaveSnapshots(argv[2]);
+      return(1);
+    }
+  if ((argc > 2) && (strcmp(argv[1],"micro") == 0))
+    {
+      Micro(argv[2],((argc > 3) ? atoi(argv[3]) : 1000));
+      return(1);
+    }
+  if ((argc > 2) && (strcmp(argv[1],"trace") == 0))
+    {
+      SummariseTrace(argv[2]);
+      return(1);
+    }
+  if ((argc > 2) && (strcmp(argv[1],"corpus") == 0))
+    {
+      WriteCorpus(argv[2]);
+      return(1);
+    }
+  if ((argc > 3) && (strcmp(argv[1],"solve") == 0))
+    {
+      SolveCorpus(argv[2],argv[3]);
+      return(1);
+    }
+  if ((argc > 2) && (strcmp(argv[1],"results") == 0))
+    {
+      PrintResults(argv[2]);
+      return(1);
+    }
+  if (strcmp(argv[1],"diff") == 0)
+    {
+      Differential(((argc > 2) ? atoi(argv[2]) : 100),((argc > 3) ? atol(argv[3]) : 1));
+      return(1);
+    }
+  if (strcmp(argv[1],"score") == 0)
+    {
+      Scores=(Submission *)malloc(ScoreBatch*sizeof(Submission));
+      do
+	{
+	  for (Count=0;(Count < ScoreBatch) && (ReadSubmission(Scores+Count));Count++);
+	  ScoreSubmissions(Scores,Count);
+	  for (i=0;i<Count;i++) PrintScore(Scores+i);
+	}
+      while (Count == ScoreBatch);
+      free(Scores);
+      return(1);
+    }
+  if ((argc >= 5) && (argv[1][0] == 'c'))
+    {
+      Count=((argc > 5) ? atoi(argv[5]) : 0);
+      ShowFits=0;
+      if (argc > 7)
+	{
+	  Solve.Species=atoi(argv[6]);
+	  Solve.Voices=MIN(atoi(argv[7]),MostVoices-1);
+	  for (i=0;i<Solve.Voices;i++) Solve.StartPitches[i]=((argc > (8+i)) ? atoi(argv[8+i]) : atoi(argv[3]));
+	  GenerateCantus(ModeNamed(argv[2]),atoi(argv[3]),atoi(argv[4]),Count,SolveCantus,(void *)&Solve);
+	}
+      else GenerateCantus(ModeNamed(argv[2]),atoi(argv[3]),atoi(argv[4]),Count,PrintCantus,NULL);
+      return(1);
+    }
+  if ((argc >= 9) && (argv[1][0] == 's'))
+    {
+      Solve.Voices=MIN(atoi(argv[7]),MostVoices-1);
+      for (i=0;i<Solve.Voices;i++) Solve.StartPitches[i]=((argc > (8+i)) ? atoi(argv[8+i]) : atoi(argv[3]));
+      if (StreamSpecies(ModeNamed(argv[2]),atoi(argv[3]),Solve.StartPitches,Solve.Voices,atoi(argv[4]),atoi(argv[5]),atoi(argv[6]),
+			ReadPitch,NULL,PrintBars,NULL) < 0)
+	fprintf(stderr,"no solution\n");
+      return(1);
+    }
+  return(0);
+}
+
+int main(int argc, char **argv)
 {
+  char *Flag;
   FillRhyPat();
+#ifdef THREADS
+  Threads=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  while ((argc > 1) && (argv[1][0] == '-'))	/* flags, in any order, up to the first word that isn't one */
+    {
+      Flag=argv[1];
+      if (strcmp(Flag,"-starts") == 0)
+	{
+	  ChooseStartPitches=1;
+	  argc--; argv++;
+	  continue;
+	}
+      if ((strcmp(Flag,"-cache") != 0) && (strcmp(Flag,"-discrepancy") != 0) && (strcmp(Flag,"-portfolio") != 0) &&
+	  (strcmp(Flag,"-budget") != 0) && (strcmp(Flag,"-nodes") != 0) && (strcmp(Flag,"-improve") != 0) &&
+	  (strcmp(Flag,"-trace") != 0))
+	{
+	  fprintf(stderr,"unknown option %s\n",Flag);
+	  return(1);
+	}
+      if (argc < 3)
+	{
+	  fprintf(stderr,"%s needs an argument\n",Flag);
+	  return(1);
+	}
+      if (strcmp(Flag,"-cache") == 0)
+	{
+	  if (!(OpenSolutionCache(argv[2],4096,1))) fprintf(stderr,"can't use %s as a cache\n",argv[2]);
+	}
+      else if (strcmp(Flag,"-discrepancy") == 0)
+	{
+	  LimitedDiscrepancy=1;
+	  DiscrepancyBudget=atoi(argv[2]);
+	}
+      else if (strcmp(Flag,"-portfolio") == 0) PortfolioSeconds=atof(argv[2]);
+      else if (strcmp(Flag,"-budget") == 0) PruneSeconds=atof(argv[2]);
+      else if (strcmp(Flag,"-nodes") == 0) PruneNodes=atol(argv[2]);
+      else if (strcmp(Flag,"-improve") == 0) ImproveSeconds=atof(argv[2]);
+      else if (!(StartTrace(argv[2]))) perror(argv[2]);	/* -trace */
+      argc-=2; argv+=2;
+    }
+  if ((argc > 1) && (Batch(argc,argv))) {EndTrace(); return(0);}
 
 #if EXS
   fillCantus(50,53,52,50,55,53,57,55,53,52,50,0,0,0,0); 
@@ -1421,7 +5498,11 @@ main()
 
   fillCantus(50,53,52,50,55,53,57,55,53,52,50,0,0,0,0);
   vbs[0]=38; vbs[1]=57; vbs[2]=62;
-  AnySpecies(Dorian,vbs,1,11,1);            /* 57 62 -- 38,45,57,62,69,53,50 */
-
+  if (!((ChooseStartPitches) && (ChooseStarts(Dorian,vbs,1,11,1) >= 0)))
+    AnySpecies(Dorian,vbs,1,11,1);          /* 57 62 -- 38,45,57,62,69,53,50 */
+  ReportBudget();
+  if (ImproveSeconds > 0) ImproveSolution(ImproveWindowBars,ImproveSeconds,NULL,NULL,0);
+  EndTrace();
+  return(0);
 }
 #endif
@@ -0,0 +1,480 @@
+/* fuxmodule.c -- fux.c as a CPython extension
+ *
+ * python setup.py build_ext --inplace creates the module
+ *
+ *   import fux
+ *   penalty, notes, durs = fux.solve(fux.DORIAN, 1, [50,53,52,50,55,53,57,55,53,52,50], [57])
+ *   penalty, notepens, rules = fux.score(fux.DORIAN, 1, cantus, [(pitches, durs)])
+ *   for penalty, notes, durs in fux.solutions(fux.DORIAN, 3, cantus, [57]): ...
+ *
+ * The cantus and start pitches can be any sequence of ints or any buffer of
+ * integers (array.array, numpy arrays...).  notes and durs are fux.Array
+ * objects: read-only (voices x notes) int buffers, zero padded, which
+ * memoryview or numpy.asarray use without copying.  The solver runs with the
+ * GIL released, and since it is built with THREADS each thread has its own
+ * copy of its state, so several Python threads can solve at once.  For the
+ * same reason a fux.Solutions iterator belongs to the thread that made it,
+ * and while its search is suspended solve, score and solutions raise
+ * RuntimeError on that thread.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#ifndef THREADS
+#define THREADS
+#endif
+#ifndef CM
+#define CM
+#endif
+#include "fux.c"
+
+typedef struct {
+  PyObject_HEAD
+  int *data;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+} FuxArray;
+
+static void FuxArray_dealloc(FuxArray *self)
+{
+  PyMem_Free(self->data);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int FuxArray_getbuffer(FuxArray *self, Py_buffer *view, int flags)
+{
+  if (PyBuffer_FillInfo(view,(PyObject *)self,self->data,self->shape[0]*self->shape[1]*sizeof(int),1,flags) < 0) return(-1);
+  view->itemsize=sizeof(int);
+  view->format=((flags & PyBUF_FORMAT) ? "i" : NULL);
+  view->ndim=2;
+  view->shape=(((flags & PyBUF_ND) == PyBUF_ND) ? self->shape : NULL);
+  view->strides=(((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? self->strides : NULL);
+  return(0);
+}
+
+static PyBufferProcs FuxArray_as_buffer = {(getbufferproc)FuxArray_getbuffer, NULL};
+
+static PyTypeObject FuxArrayType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "fux.Array",
+  .tp_basicsize = sizeof(FuxArray),
+  .tp_dealloc = (destructor)FuxArray_dealloc,
+  .tp_as_buffer = &FuxArray_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "read-only (voices x notes) int buffer",
+};
+
+static FuxArray *NewArray(int rows, int cols)
+{
+  FuxArray *a;
+  a=PyObject_New(FuxArray,&FuxArrayType);
+  if (a == NULL) return(NULL);
+  a->data=(int *)PyMem_Calloc(MAX(1,rows*cols),sizeof(int));
+  if (a->data == NULL)
+    {
+      Py_DECREF(a);
+      PyErr_NoMemory();
+      return(NULL);
+    }
+  a->shape[0]=rows; a->shape[1]=cols;
+  a->strides[0]=cols*sizeof(int); a->strides[1]=sizeof(int);
+  return(a);
+}
+
+/* read up to most ints from a buffer of integers or a sequence, returning how many (-1 on error) */
+static int GetPitches(PyObject *obj, int *pitches, int most, char *what)
+{
+  Py_buffer view;
+  PyObject *seq;
+  Py_ssize_t i,n;
+  char *p;
+  if (PyObject_CheckBuffer(obj))
+    {
+      if (PyObject_GetBuffer(obj,&view,PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) return(-1);
+      n=(view.len/view.itemsize);
+      if ((view.format == NULL) || (strchr("bBhHiIlLqQ",view.format[0]) == NULL) || (view.format[1] != 0))
+	{
+	  PyBuffer_Release(&view);
+	  PyErr_Format(PyExc_TypeError,"%s must be a buffer of integers",what);
+	  return(-1);
+	}
+      if (n > most)
+	{
+	  PyBuffer_Release(&view);
+	  PyErr_Format(PyExc_ValueError,"%s has more than %d notes",what,most);
+	  return(-1);
+	}
+      p=(char *)view.buf;
+      for (i=0;i<n;i++,p+=view.itemsize)
+	{
+	  switch (view.itemsize)
+	    {
+	    case 1: pitches[i]=((view.format[0] == 'b') ? *(signed char *)p : *(unsigned char *)p); break;
+	    case 2: pitches[i]=*(short *)p; break;
+	    case 4: pitches[i]=*(int *)p; break;
+	    default: pitches[i]=(int)(*(long long *)p); break;
+	    }
+	}
+      PyBuffer_Release(&view);
+      return((int)n);
+    }
+  seq=PySequence_Fast(obj,"expected a sequence or buffer of pitches");
+  if (seq == NULL) return(-1);
+  n=PySequence_Fast_GET_SIZE(seq);
+  if (n > most)
+    {
+      Py_DECREF(seq);
+      PyErr_Format(PyExc_ValueError,"%s has more than %d notes",what,most);
+      return(-1);
+    }
+  for (i=0;i<n;i++)
+    {
+      pitches[i]=(int)PyLong_AsLong(PySequence_Fast_GET_ITEM(seq,i));
+      if ((pitches[i] == -1) && (PyErr_Occurred()))
+	{
+	  Py_DECREF(seq);
+	  return(-1);
+	}
+    }
+  Py_DECREF(seq);
+  return((int)n);
+}
+
+/* parse solve's arguments, returning the number of voices (-1 on error); seconds and nodes are only solve's */
+static int GetJob(PyObject *args, PyObject *kwds, int *mode, int *species, int *cantus, int *len, int *starts, double *seconds, long *nodes)
+{
+  static char *kwlist[] = {"mode", "species", "cantus", "starts", NULL};
+  static char *budgetkwlist[] = {"mode", "species", "cantus", "starts", "seconds", "nodes", NULL};
+  int voices;
+  PyObject *cantusobj,*startsobj;
+  if (seconds)
+    {
+      if (!PyArg_ParseTupleAndKeywords(args,kwds,"iiOO|dl",budgetkwlist,mode,species,&cantusobj,&startsobj,seconds,nodes)) return(-1);
+      if ((*seconds < 0) || (*nodes < 0)) {PyErr_Format(PyExc_ValueError,"budgets can't be negative"); return(-1);}
+    }
+  else if (!PyArg_ParseTupleAndKeywords(args,kwds,"iiOO",kwlist,mode,species,&cantusobj,&startsobj)) return(-1);
+  if ((*mode < Aeolian) || (*mode > Locrian)) {PyErr_Format(PyExc_ValueError,"unknown mode %d",*mode); return(-1);}
+  if ((*species < 1) || (*species > 5)) {PyErr_Format(PyExc_ValueError,"species must be 1 to 5"); return(-1);}
+  *len=GetPitches(cantusobj,cantus,MostNotes-1,"cantus");
+  if (*len < 0) return(-1);
+  if (*len < 3) {PyErr_Format(PyExc_ValueError,"cantus is too short"); return(-1);}
+  if (((*len)*((*species == 5) ? 6 : ((*species == 3) ? 4 : 2))) >= MostNotes)	/* room for the counterpoint's notes */
+    {
+      PyErr_Format(PyExc_ValueError,"cantus is too long for species %d",*species);
+      return(-1);
+    }
+  voices=GetPitches(startsobj,starts,MostVoices-1,"starts");
+  if (voices < 0) return(-1);
+  if (voices < 1) {PyErr_Format(PyExc_ValueError,"need at least one start pitch"); return(-1);}
+  return(voices);
+}
+
+/* (penalty, notes, durs) from this thread's BestFit */
+static PyObject *Solution(int voices, int Penalty)
+{
+  int v,i,cols;
+  FuxArray *notes,*durs;
+  cols=0;
+  for (v=1;v<=voices;v++) cols=MAX(cols,TotalNotes[v]);
+  notes=NewArray(voices,cols);
+  if (notes == NULL) return(NULL);
+  durs=NewArray(voices,cols);
+  if (durs == NULL)
+    {
+      Py_DECREF(notes);
+      return(NULL);
+    }
+  for (v=1;v<=voices;v++)
+    for (i=1;i<=TotalNotes[v];i++)
+      {
+	notes->data[((v-1)*cols)+i-1]=BestFit[i][v];
+	durs->data[((v-1)*cols)+i-1]=Dur[i][v];
+      }
+  if (Penalty >= infinity) Penalty=-1;	/* no solution */
+  return(Py_BuildValue("iNN",Penalty,(PyObject *)notes,(PyObject *)durs));
+}
+
+/* a suspended fux.Solutions search owns this thread's solver state */
+static int Idle()
+{
+  if (!(SearchSuspended())) return(1);
+  PyErr_SetString(PyExc_RuntimeError,"a fux.Solutions search is suspended on this thread; run it out or close it first");
+  return(0);
+}
+
+static PyObject *fux_solve(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  int mode,species,len,voices;
+  int cantus[MostNotes],starts[MostVoices];
+  double seconds=0;
+  long nodes=0;
+  if (!(Idle())) return(NULL);
+  voices=GetJob(args,kwds,&mode,&species,cantus,&len,starts,&seconds,&nodes);
+  if (voices < 0) return(NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  BudgetSeconds=seconds;
+  BudgetNodes=nodes;
+  fux(mode,species,voices,len,starts,cantus);
+  BudgetSeconds=0;
+  BudgetNodes=0;
+  Py_END_ALLOW_THREADS
+
+  /* still the same thread, so the solver's (thread local) results are ours */
+  return(Solution(voices,BestFitPenalty));
+}
+
+/* fux.solutions: an iterator over a search's improving fits (see OpenSolutions) */
+
+typedef struct {
+  PyObject_HEAD
+  SolutionIterator *it;
+  int voices;
+  int below;
+} FuxSolutions;
+
+static void FuxSolutions_dealloc(FuxSolutions *self)
+{
+  if ((self->it) && (CloseSolutions(self->it) == -2) &&
+      (PyErr_WarnEx(PyExc_RuntimeWarning,"fux.Solutions dropped outside the thread that made it; its search is left for that thread to unwind",1) < 0))
+    PyErr_WriteUnraisable((PyObject *)self);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *FuxSolutions_next(FuxSolutions *self)
+{
+  int Penalty;
+  if (self->it == NULL) return(NULL);
+  Py_BEGIN_ALLOW_THREADS
+  Penalty=NextSolution(self->it,self->below);
+  Py_END_ALLOW_THREADS
+  if (Penalty == -2) return(PyErr_Format(PyExc_RuntimeError,"fux.Solutions used outside the thread that made it"));
+  if (Penalty == -3) return(PyErr_Format(PyExc_RuntimeError,"another fux.Solutions search is suspended on this thread; run it out or close it first"));
+  if (Penalty < 0) return(NULL);	/* StopIteration */
+  return(Solution(self->voices,Penalty));
+}
+
+static PyObject *FuxSolutions_below(FuxSolutions *self, PyObject *arg)
+{
+  long p;
+  p=PyLong_AsLong(arg);
+  if ((p == -1) && (PyErr_Occurred())) return(NULL);
+  self->below=(int)MIN(MAX(p,0),infinity);
+  Py_RETURN_NONE;
+}
+
+static PyObject *FuxSolutions_close(FuxSolutions *self, PyObject *unused)
+{
+  int Closed;
+  if (self->it)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      Closed=CloseSolutions(self->it);
+      Py_END_ALLOW_THREADS
+      self->it=NULL;
+      if (Closed == -2) return(PyErr_Format(PyExc_RuntimeError,"fux.Solutions closed outside the thread that made it; its search is left for that thread to unwind"));
+    }
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef FuxSolutionsMethods[] = {
+  {"below", (PyCFunction)FuxSolutions_below, METH_O, "below(penalty): from now on only yield fits under penalty"},
+  {"close", (PyCFunction)FuxSolutions_close, METH_NOARGS, "close(): abandon the search"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject FuxSolutionsType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "fux.Solutions",
+  .tp_basicsize = sizeof(FuxSolutions),
+  .tp_dealloc = (destructor)FuxSolutions_dealloc,
+  .tp_iter = PyObject_SelfIter,
+  .tp_iternext = (iternextfunc)FuxSolutions_next,
+  .tp_methods = FuxSolutionsMethods,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "iterator over a search's improving fits",
+};
+
+static PyObject *fux_solutions(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  int mode,species,len,voices;
+  int cantus[MostNotes],starts[MostVoices];
+  FuxSolutions *s;
+  if (!(Idle())) return(NULL);
+  voices=GetJob(args,kwds,&mode,&species,cantus,&len,starts,NULL,NULL);
+  if (voices < 0) return(NULL);
+  if (rhyfilled == 0)
+    {
+      rhyfilled = 1;
+      FillRhyPat();
+    }
+  s=PyObject_New(FuxSolutions,&FuxSolutionsType);
+  if (s == NULL) return(NULL);
+  s->voices=voices;
+  s->below=infinity;
+  s->it=OpenSolutions(mode,starts,voices,cantus,len,species);
+  if (s->it == NULL)
+    {
+      Py_DECREF(s);
+      return(PyErr_NoMemory());
+    }
+  return((PyObject *)s);
+}
+
+static PyObject *fux_score(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"mode", "species", "cantus", "voices", NULL};
+  int mode,species,v,i,cols,n,Penalty;
+  int durs[MostNotes];
+  PyObject *cantusobj,*voicesobj,*seq,*voice,*rules;
+  Submission *s;
+  FuxArray *pens;
+  if (!(Idle())) return(NULL);
+  if (!PyArg_ParseTupleAndKeywords(args,kwds,"iiOO",kwlist,&mode,&species,&cantusobj,&voicesobj)) return(NULL);
+  if ((mode < Aeolian) || (mode > Locrian)) return(PyErr_Format(PyExc_ValueError,"unknown mode %d",mode));
+  if ((species < 1) || (species > 5)) return(PyErr_Format(PyExc_ValueError,"species must be 1 to 5"));
+  s=(Submission *)PyMem_Calloc(1,sizeof(Submission));
+  if (s == NULL) return(PyErr_NoMemory());
+  s->Mode=mode;
+  s->Species=species;
+  s->Length=GetPitches(cantusobj,s->Cantus,MostNotes-1,"cantus");
+  seq=((s->Length < 0) ? NULL : PySequence_Fast(voicesobj,"voices must be a sequence of (pitches, durs)"));
+  if (seq == NULL)
+    {
+      PyMem_Free(s);
+      return(NULL);
+    }
+  s->Voices=(int)PySequence_Fast_GET_SIZE(seq);
+  if ((s->Voices < 1) || (s->Voices >= MostVoices))
+    {
+      Py_DECREF(seq);
+      PyMem_Free(s);
+      return(PyErr_Format(PyExc_ValueError,"need 1 to %d voices",MostVoices-1));
+    }
+  for (v=1;v<=s->Voices;v++)
+    {
+      voice=PySequence_Fast_GET_ITEM(seq,v-1);
+      if ((!(PyTuple_Check(voice) || PyList_Check(voice))) || (PySequence_Fast_GET_SIZE(voice) != 2))
+	{
+	  PyErr_Format(PyExc_TypeError,"voice %d must be (pitches, durs)",v);
+	  n=-1;
+	}
+      else
+	{
+	  n=GetPitches(PySequence_Fast_GET_ITEM(voice,0),s->Pitches[v]+1,MostNotes-1,"pitches");
+	  if ((n >= 0) && (GetPitches(PySequence_Fast_GET_ITEM(voice,1),durs,MostNotes-1,"durs") != n))
+	    {
+	      if (!(PyErr_Occurred())) PyErr_Format(PyExc_ValueError,"voice %d has %d pitches but not as many durs",v,n);
+	      n=-1;
+	    }
+	}
+      if (n < 0)
+	{
+	  Py_DECREF(seq);
+	  PyMem_Free(s);
+	  return(NULL);
+	}
+      s->Notes[v]=n;
+      for (i=0;i<n;i++) s->Durs[v][i+1]=durs[i];
+    }
+  Py_DECREF(seq);
+
+  Py_BEGIN_ALLOW_THREADS
+  ScoreSubmission(s);
+  Py_END_ALLOW_THREADS
+
+  Penalty=s->Penalty;
+  if (Penalty < 0)
+    {
+      PyMem_Free(s);
+      return(PyErr_Format(PyExc_ValueError,"the voices don't fit the cantus"));
+    }
+  cols=0;
+  for (v=1;v<=s->Voices;v++) cols=MAX(cols,s->Notes[v]);
+  pens=NewArray(s->Voices,cols);
+  rules=((pens == NULL) ? NULL : PyDict_New());
+  if (rules == NULL)
+    {
+      Py_XDECREF(pens);
+      PyMem_Free(s);
+      return(NULL);
+    }
+  for (v=1;v<=s->Voices;v++)
+    for (i=1;i<=s->Notes[v];i++) pens->data[((v-1)*cols)+i-1]=s->NotePenalty[v][i];
+  for (i=0;i<NumberOfRules;i++)
+    if (s->RulePenalty[i])
+      {
+	PyObject *val=PyLong_FromLong(s->RulePenalty[i]);
+	if ((val == NULL) || (PyDict_SetItemString(rules,RuleNames[i],val) < 0))
+	  {
+	    Py_XDECREF(val);
+	    Py_DECREF(rules);
+	    Py_DECREF(pens);
+	    PyMem_Free(s);
+	    return(NULL);
+	  }
+	Py_DECREF(val);
+      }
+  PyMem_Free(s);
+  return(Py_BuildValue("iNN",Penalty,(PyObject *)pens,rules));
+}
+
+static PyObject *fux_floor(PyObject *self, PyObject *args)
+{
+  if (SearchFloor >= infinity) return(PyLong_FromLong(-1));
+  return(PyLong_FromLong(SearchFloor));
+}
+
+static PyMethodDef FuxMethods[] = {
+  {"solve", (PyCFunction)fux_solve, METH_VARARGS | METH_KEYWORDS,
+   "solve(mode, species, cantus, starts, seconds=0, nodes=0) -> (penalty, notes, durs)\n\n"
+   "Harmonize cantus with len(starts) voices beginning on starts (voice 1 is the bass).\n"
+   "penalty is -1 if nothing was found.  notes and durs are (voices x notes) int buffers,\n"
+   "durations in eighths (8 = whole note).  Given seconds or nodes (onsets expanded),\n"
+   "the search prunes harder as that budget runs out and stops once it is spent;\n"
+   "floor() then says how much it might have given up."},
+  {"floor", (PyCFunction)fux_floor, METH_NOARGS,
+   "floor() -> penalty\n\n"
+   "A lower bound on the best fit the last solve on this thread could have found without\n"
+   "pruning, so solve's penalty minus floor() is the gap its pruning gave up (none if they\n"
+   "are equal).  After a cached solve only 0 is known; -1 if nothing was found or cut."},
+  {"solutions", (PyCFunction)fux_solutions, METH_VARARGS | METH_KEYWORDS,
+   "solutions(mode, species, cantus, starts) -> iterator of (penalty, notes, durs)\n\n"
+   "Like solve, but the search runs only as far as the iterator is taken, yielding\n"
+   "each fit better than the last as it is found; the last one is solve's answer.\n"
+   "s.below(penalty) asks only for fits under penalty from then on, and s.close()\n"
+   "(or dropping s) abandons the search.  Use s only on the thread that made it."},
+  {"score", (PyCFunction)fux_score, METH_VARARGS | METH_KEYWORDS,
+   "score(mode, species, cantus, voices) -> (penalty, notepens, rules)\n\n"
+   "Check existing counterpoint against the rules without searching.  voices is a sequence\n"
+   "of (pitches, durs), bass first, the last in species and the others in first species.\n"
+   "notepens is a (voices x notes) int buffer of what each note cost (the first notes are\n"
+   "given, so cost nothing), and rules maps the name of each rule that charged to its total."},
+  {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef fuxmodule = {PyModuleDef_HEAD_INIT, "fux", "Automatic species counterpoint (Schottstaedt)", -1, FuxMethods};
+
+PyMODINIT_FUNC PyInit_fux(void)
+{
+  PyObject *m;
+  int i;
+  if (PyType_Ready(&FuxArrayType) < 0) return(NULL);
+  if (PyType_Ready(&FuxSolutionsType) < 0) return(NULL);
+  m=PyModule_Create(&fuxmodule);
+  if (m == NULL) return(NULL);
+  Py_INCREF(&FuxArrayType);
+  PyModule_AddObject(m,"Array",(PyObject *)&FuxArrayType);
+  Py_INCREF(&FuxSolutionsType);
+  PyModule_AddObject(m,"Solutions",(PyObject *)&FuxSolutionsType);
+  for (i=Aeolian;i<=Locrian;i++)
+    {
+      char name[16];
+      int j;
+      for (j=0;ModeNames[i][j];j++) name[j]=(ModeNames[i][j] & ~040);
+      name[j]=0;
+      PyModule_AddIntConstant(m,name,i);
+    }
+  return(m);
+}
@@ -0,0 +1,8 @@
+# python setup.py build_ext --inplace builds the fux module (see fuxmodule.c)
+from setuptools import setup, Extension
+
+setup(name='fux',
+      version='1.0',
+      description='Automatic species counterpoint (Schottstaedt)',
+      ext_modules=[Extension('fux', sources=['fuxmodule.c'], depends=['fux.c'],
+                             define_macros=[('THREADS', None), ('CM', None)])])